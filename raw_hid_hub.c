@@ -5,10 +5,15 @@
 #ifndef _WIN32
 #    define _POSIX_C_SOURCE 200809L
 #endif
+#ifdef __linux__
+#    define _GNU_SOURCE  // for cpu affinity
+#endif
 
+#include <assert.h>
 #include <signal.h>
 #include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,7 +25,17 @@
 #    include <windows.h>
 #else
 #    include <errno.h>
+#    include <poll.h>
 #    include <pthread.h>
+#    include <sched.h>
+#    include <sys/mman.h>
+#endif
+
+#ifdef __linux__
+#    include <fcntl.h>
+#    include <sys/epoll.h>
+#    include <sys/eventfd.h>
+#    include <unistd.h>
 #endif
 
 // ============================================================================
@@ -39,17 +54,137 @@
 
 // control speed of the main loop
 #define USE_SLEEP_WINDOWS
-#define USE_SMART_SLEEP_WINDOWS 
 #define SLEEP_MILLISECONDS_WINDOWS 1  // actual sleep duration depends on timer precision
-#define SMART_SLEEP_WAIT_MILLISECONDS_WINDOWS 100
 #define USE_SLEEP_POSIX
-#define USE_SMART_SLEEP_POSIX
 #define SLEEP_MILLISECONDS_POSIX 4.16666667
-#define SMART_SLEEP_WAIT_MILLISECONDS_POSIX 100
+
+// idle tiers: hot (no sleep) while reports are flowing, warm (SLEEP_MILLISECONDS_*) for a while after that, then cold
+#define USE_IDLE_TIERS_WINDOWS
+#define USE_IDLE_TIERS_POSIX
+#define IDLE_WARM_AFTER_MILLISECONDS 100  // hot -> warm after this long without reports
+#define IDLE_COLD_AFTER_MILLISECONDS 10000  // warm -> cold after this long without reports
+#define IDLE_PROMOTE_REPORTS 2  // reports needed within a tier before moving to the next hotter one
+#define IDLE_PROMOTE_WINDOW_MILLISECONDS 100  // those reports have to arrive within this long of the first one
+#define COLD_SLEEP_MILLISECONDS_WINDOWS 16
+#define COLD_SLEEP_MILLISECONDS_POSIX 16.6666667
+
+// posix only: sleep until absolute deadlines so that time spent on hid i/o doesn't stretch the loop period
+#define USE_PRECISION_TICK_POSIX
+// posix only: round the loop period to whole milliseconds and put every tick at the same offset past a 1 ms boundary
+// of CLOCK_MONOTONIC (not phase-locked to the bus SOF, which the host doesn't expose)
+// #define USE_USB_FRAME_ALIGNMENT_POSIX
+#define USB_FRAME_OFFSET_MICROSECONDS 250
+
+// linux only: block on the hidraw file descriptors with epoll instead of sleeping (requires the hidraw backend)
+// #define USE_EPOLL_LINUX
+
+// linux only: keep a read outstanding on every device and batch all i/o through one io_uring (requires linux 5.11)
+// #define USE_IO_URING_LINUX
+#define IO_URING_ENTRIES 256  // size of the submission queue
+#define IO_URING_WRITES_PER_DEVICE 8  // how many writes to one device can be in flight at once
+
+// posix only: give every device a thread that blocks on reads and passes reports to the main loop through a ring
+// #define USE_READER_THREADS_POSIX
+#define READER_TIMEOUT_MILLISECONDS 100  // how often reader threads check whether they should stop
+
+// posix only: give every device a thread that does its writes, so that one slow device can't hold up the others
+// #define USE_WRITER_THREADS_POSIX
+#define WRITER_TIMEOUT_MILLISECONDS 50  // reports that waited longer than this for their write are dropped
+
+// how many reports a reader or writer thread can hold, must be a power of two
+#define REPORT_RING_CAPACITY 64
+
+// how many reports can wait for one destination device, must be a power of two
+#define MESSAGE_QUEUE_CAPACITY 64
+
+// how many reports other threads can leave for one destination device until its own thread takes them, must be a power of two
+#define MESSAGE_INBOX_CAPACITY 16
+
+// what happens to a report for a full queue: OVERFLOW_POLICY_DROP_NEWEST drops it,
+// OVERFLOW_POLICY_DROP_OLDEST drops the oldest queued report instead, and
+// OVERFLOW_POLICY_BLOCK_ORIGIN stops reading from the sender until the queue has room
+#define MESSAGE_QUEUE_OVERFLOW_POLICY OVERFLOW_POLICY_DROP_NEWEST
+
+// what happens to forwarded reports that waited too long in a queue: QUEUE_DELAY_POLICY_NONE sends them anyway,
+// QUEUE_DELAY_POLICY_TTL drops every report that waited longer than QUEUE_DELAY_BUDGET_MICROSECONDS, and
+// QUEUE_DELAY_POLICY_CODEL starts dropping once the wait stayed above the budget for CODEL_INTERVAL_MICROSECONDS,
+// and then drops more often until the wait is back under the budget, both drop reports and are opt-in
+#ifndef QUEUE_DELAY_POLICY  // tests/queue_delay.c is built once with each policy that drops
+#define QUEUE_DELAY_POLICY QUEUE_DELAY_POLICY_NONE
+#endif
+#define QUEUE_DELAY_BUDGET_MICROSECONDS 50000
+#define CODEL_INTERVAL_MICROSECONDS 100000
+
+// status reports from the hub wait in a control lane of their own, which never blocks or drops device reports,
+// once it's full, the oldest status report makes way since the newer one supersedes it (power of two)
+#define CONTROL_QUEUE_CAPACITY 4
+// LANE_SCHEDULER_STRICT writes the control lane before any device report, and
+// LANE_SCHEDULER_WEIGHTED writes at most CONTROL_LANE_WEIGHT control reports in a row while device reports wait
+#define LANE_SCHEDULER LANE_SCHEDULER_STRICT
+#define CONTROL_LANE_WEIGHT 4
+
+// a new report replaces a queued one from the same origin to the same destination if their key bytes match,
+// offsets count from the command id, so 2 is the first byte after the device id
+// #define USE_COALESCING
+#define COALESCING_KEY_OFFSETS {2}
+
+// nodes, message queues and stats counters come from pools that are sized here and allocated at startup
+#define MAX_OPEN_DEVICES 64  // registered or not
+#define MAX_DEVICE_PATH_LENGTH 256  // devices with longer paths are skipped
+
+// upper bound for the pools and the static tables together in kilobytes (0 for none), if it's less than the limits
+// above add up to, fewer reports fit in the queues and the oldest queued reports are shed once messages run low
+#define MEMORY_BUDGET_KILOBYTES 0
+
+// debug, linux only (glibc): replace malloc for the whole process, including hidapi and libc,
+// and abort on any heap allocation from a router thread once its main loop has started (not with sanitizers, they replace malloc too)
+// #define USE_ALLOCATION_CHECK_LINUX
+
+// tell the origin of a dropped report whether its destination was busy or unreachable,
+// at most once per BACKPRESSURE_NOTICE_INTERVAL_MS and origin, under their own command id so that firmware that doesn't know them ignores them
+// #define USE_BACKPRESSURE_NOTICES
+#define BACKPRESSURE_NOTICE_INTERVAL_MS 100
+#define BACKPRESSURE_NOTICE_COMMAND_ID 0x28
+
+// write forwarded reports to their destination right away instead of waiting for the destination's turn
+// #define USE_CUT_THROUGH
+
+// how reads are shared between devices: READ_SCHEDULER_DRAIN reads each device until it's empty, as the hub always did,
+// READ_SCHEDULER_ROUND_ROBIN reads at most READ_QUANTUM reports per visit, and
+// READ_SCHEDULER_DEFICIT_ROUND_ROBIN reads READ_QUANTUM * read_weight reports per visit on average
+#define READ_SCHEDULER READ_SCHEDULER_DRAIN
+#define READ_QUANTUM 4
+
+// per-device settings, matched by vendor and product id, fields that are left out use the defaults
+// queue_capacity and overflow_policy apply to the queue of reports waiting for that device
+#define DEVICE_CONFIGS { \
+    {.vendor_id = 0x0000, .product_id = 0x0000, .read_weight = 1.0, .queue_capacity = MESSAGE_QUEUE_CAPACITY, .overflow_policy = OVERFLOW_POLICY_DEFAULT}, \
+}
+
+// defaults for low latency mode (-l), see README.md
+#define LOW_LATENCY_MAIN_CPU 1  // -1 to leave the main loop unpinned
+#define LOW_LATENCY_ENUMERATION_CPU 0  // -1 to leave the enumeration thread unpinned
+#define LOW_LATENCY_PRIORITY 50  // SCHED_FIFO priority for the main loop, 0 to keep the normal scheduler
+
+// posix only: split the devices between this many router threads, each running its own main loop (1 to disable)
+#define ROUTER_SHARDS 1
+
+// posix only: give every device id an inbox that other threads can leave reports in with message_inbox_inject(),
+// router shards always have them, otherwise they cost about 250 KB for nothing
+// #define USE_MESSAGE_INBOXES
 
 // control speed of the child loop
 #define SECONDS_PER_ENUMERATION 1
 
+// linux only: open and close devices as soon as udev reports hidraw nodes coming and going,
+// then a full enumeration only runs every SECONDS_PER_SAFETY_ENUMERATION in case an event was missed
+// #define USE_HOTPLUG_LINUX
+#define SECONDS_PER_SAFETY_ENUMERATION 60
+
+// linux only: find raw hid devices by reading their report descriptors from sysfs instead of enumerating every hid device,
+// and watch /dev with inotify so new hidraw nodes are opened without udev (can't be used with USE_HOTPLUG_LINUX)
+// #define USE_SYSFS_DISCOVERY_LINUX
+
 // ============================================================================
 // MACROS
 // ============================================================================
@@ -66,6 +201,173 @@
 
 #define DEVICE_ID_IS_VALID(device_id) (0 <= device_id && device_id < N_UNIQUE_DEVICE_IDS)
 
+// byte 2 of backpressure notices
+#define BACKPRESSURE_NOTICE_BUSY 0x01
+#define BACKPRESSURE_NOTICE_UNREACHABLE 0x02
+
+// open devices by path, a couple of buckets per device keeps the chains short
+#define NODE_INDEX_BUCKETS (2 * MAX_OPEN_DEVICES)
+
+// a message's report without the report id
+#define MESSAGE_DATA(message) ((message)->report_id_and_data + 1)
+
+// messages that are kept for reading and holding reports, queued reports are shed before the pool gets this low
+#define MESSAGE_POOL_RESERVE (MAX_OPEN_DEVICES + 1)
+
+// read schedulers
+#define READ_SCHEDULER_DRAIN 0
+#define READ_SCHEDULER_ROUND_ROBIN 1
+#define READ_SCHEDULER_DEFICIT_ROUND_ROBIN 2
+
+// message queue overflow policies
+#define OVERFLOW_POLICY_DEFAULT 0  // MESSAGE_QUEUE_OVERFLOW_POLICY
+#define OVERFLOW_POLICY_DROP_NEWEST 1
+#define OVERFLOW_POLICY_DROP_OLDEST 2
+#define OVERFLOW_POLICY_BLOCK_ORIGIN 3
+
+// queue delay policies
+#define QUEUE_DELAY_POLICY_NONE 0
+#define QUEUE_DELAY_POLICY_TTL 1
+#define QUEUE_DELAY_POLICY_CODEL 2
+
+// schedulers between the control and device lanes of a queue
+#define LANE_SCHEDULER_STRICT 0
+#define LANE_SCHEDULER_WEIGHTED 1
+
+// loop period histogram: 1 us buckets up to 1 ms, then 100 us buckets up to 100 ms
+#define LOOP_PERIOD_FINE_BUCKETS 1000
+#define LOOP_PERIOD_COARSE_BUCKETS 990
+#define LOOP_PERIOD_BUCKETS (LOOP_PERIOD_FINE_BUCKETS + LOOP_PERIOD_COARSE_BUCKETS + 1)
+
+// full speed usb frame
+#define USB_FRAME_NANOSECONDS 1000000ULL
+
+// linux only features are ignored elsewhere
+#ifndef __linux__
+#    undef USE_EPOLL_LINUX
+#    undef USE_IO_URING_LINUX
+#    undef USE_HOTPLUG_LINUX
+#    undef USE_SYSFS_DISCOVERY_LINUX
+#endif
+#ifndef __GLIBC__
+#    undef USE_ALLOCATION_CHECK_LINUX
+#endif
+#ifdef _WIN32
+#    undef USE_PRECISION_TICK_POSIX
+#    undef USE_USB_FRAME_ALIGNMENT_POSIX
+#    undef USE_READER_THREADS_POSIX
+#    undef USE_WRITER_THREADS_POSIX
+#    undef ROUTER_SHARDS
+#    define ROUTER_SHARDS 1
+#endif
+
+#if defined(USE_EPOLL_LINUX) && defined(USE_READER_THREADS_POSIX)
+#    error "USE_EPOLL_LINUX and USE_READER_THREADS_POSIX can't be used together"
+#endif
+
+#if defined(USE_IO_URING_LINUX) && (defined(USE_EPOLL_LINUX) || defined(USE_READER_THREADS_POSIX) || defined(USE_WRITER_THREADS_POSIX))
+#    error "USE_IO_URING_LINUX can't be used together with USE_EPOLL_LINUX or reader and writer threads"
+#endif
+
+#if defined(USE_HOTPLUG_LINUX) && defined(USE_SYSFS_DISCOVERY_LINUX)
+#    error "USE_HOTPLUG_LINUX and USE_SYSFS_DISCOVERY_LINUX can't be used together"
+#endif
+
+// the child waits for device nodes coming and going instead of enumerating every SECONDS_PER_ENUMERATION
+#if defined(USE_HOTPLUG_LINUX) || defined(USE_SYSFS_DISCOVERY_LINUX)
+#    define USE_HOTPLUG_EVENTS
+#endif
+
+#if ROUTER_SHARDS > 1
+#    define USE_ROUTER_SHARDS
+#    define USE_MESSAGE_INBOXES
+#endif
+#if ROUTER_SHARDS < 1 || ROUTER_SHARDS > 32
+#    error "ROUTER_SHARDS must be between 1 and 32"
+#endif
+
+#if defined(USE_READER_THREADS_POSIX) || defined(USE_WRITER_THREADS_POSIX) || defined(USE_IO_URING_LINUX)
+#    define USE_REPORT_RINGS
+#endif
+
+// keeps atomics that different threads write to from sharing a cache line
+#define CACHE_LINE_SIZE 64
+
+// reports that were read in the background wait in a ring until the main loop gets to them
+#if defined(USE_READER_THREADS_POSIX) || defined(USE_IO_URING_LINUX)
+#    define USE_READ_RINGS
+#endif
+
+// the main loop blocks until the child or a device gives it something to do
+#if defined(USE_EPOLL_LINUX) || defined(USE_READER_THREADS_POSIX) || defined(USE_IO_URING_LINUX)
+#    define USE_MAIN_LOOP_WAKE
+#    undef USE_PRECISION_TICK_POSIX
+#    undef USE_USB_FRAME_ALIGNMENT_POSIX
+#endif
+
+#if (defined(_WIN32) && defined(USE_IDLE_TIERS_WINDOWS)) || (!defined(_WIN32) && defined(USE_IDLE_TIERS_POSIX))
+#    define USE_IDLE_TIERS
+#endif
+
+// each shard has its own event loop state, but there's only one wake mechanism
+#if defined(USE_ROUTER_SHARDS) && defined(USE_MAIN_LOOP_WAKE)
+#    error "ROUTER_SHARDS can't be used together with USE_EPOLL_LINUX, USE_IO_URING_LINUX or reader threads"
+#endif
+
+// state that every router shard keeps for itself
+#ifdef USE_ROUTER_SHARDS
+#    define SHARD_LOCAL _Thread_local
+#else
+#    define SHARD_LOCAL
+#endif
+
+// talk to /dev/hidraw* directly when we need file descriptors
+#if defined(USE_EPOLL_LINUX) || defined(USE_IO_URING_LINUX)
+#    define USE_HIDRAW_FD
+#endif
+
+// tags in the low bits of io_uring user data, the rest is a node pointer (NULL for wake_fd)
+#define IO_URING_OP_READ 0
+#define IO_URING_OP_WRITE 1
+#define IO_URING_OP_CANCEL 2
+#define IO_URING_OP_MASK 3
+
+// ============================================================================
+// IO_URING
+// ============================================================================
+
+// no liburing, the raw interface is small enough
+#ifdef USE_IO_URING_LINUX
+#    include <linux/io_uring.h>
+#    include <linux/time_types.h>
+#    include <sys/syscall.h>
+#endif
+
+// ============================================================================
+// HOTPLUG
+// ============================================================================
+
+// no libudev, its netlink messages are easy enough to read
+#ifdef USE_HOTPLUG_LINUX
+#    include <linux/netlink.h>
+#    include <sys/socket.h>
+#    define HOTPLUG_NETLINK_GROUP_UDEV 2  // events that udev has finished processing, so the device node is ready
+#    define HOTPLUG_BUFFER_SIZE 8192
+#endif
+
+// no libudev either, sysfs has the report descriptors and inotify sees /dev changing
+#ifdef USE_SYSFS_DISCOVERY_LINUX
+#    include <dirent.h>
+#    include <sys/inotify.h>
+#    define HOTPLUG_BUFFER_SIZE 4096
+#endif
+
+// both open a new hidraw node on their own after reading its report descriptor from sysfs
+#ifdef USE_HOTPLUG_EVENTS
+#    define SYSFS_HIDRAW_CACHE_SIZE 64  // hidraw minors below this remember what their device was
+#    define SYSFS_REPORT_DESCRIPTOR_SIZE 4096  // HID_MAX_DESCRIPTOR_SIZE
+#endif
+
 // ============================================================================
 // HIDAPI
 // ============================================================================
@@ -95,25 +397,197 @@
 // TYPEDEFS
 // ============================================================================
 
+#ifdef USE_HIDRAW_FD
+typedef int raw_hid_handle_t;
+#    define RAW_HID_HANDLE_INVALID -1
+#else
+typedef hid_device* raw_hid_handle_t;
+#    define RAW_HID_HANDLE_INVALID NULL
+#endif
+
+typedef struct raw_hid_report_t {
+    uint64_t time_ns;  // when the report was read from the device
+    int length;
+    unsigned char data[QMK_RAW_HID_REPORT_SIZE];
+} raw_hid_report_t;
+
+typedef struct raw_hid_report_ring_t {
+    raw_hid_report_t reports[REPORT_RING_CAPACITY];
+    atomic_uint head;  // only set by consumer
+    atomic_uint tail;  // only set by producer
+    atomic_uint n_dropped;
+} raw_hid_report_ring_t;
+
+typedef struct raw_hid_message_inbox_cell_t {
+    atomic_uint sequence;  // says whether the cell is free or filled for the current lap
+    raw_hid_report_t report;
+} raw_hid_message_inbox_cell_t;
+
+typedef struct raw_hid_message_inbox_t {
+    _Alignas(CACHE_LINE_SIZE) atomic_uint tail;  // claimed by producers
+    _Alignas(CACHE_LINE_SIZE) atomic_uint head;  // only set by consumer
+    _Alignas(CACHE_LINE_SIZE) raw_hid_message_inbox_cell_t cells[MESSAGE_INBOX_CAPACITY];
+} raw_hid_message_inbox_t;
+
+typedef struct raw_hid_writer_stats_t {
+    atomic_uint n_writes;
+    atomic_uint n_slow;  // writes that took longer than WRITER_TIMEOUT_MILLISECONDS
+    atomic_uint n_expired;  // reports that waited longer than WRITER_TIMEOUT_MILLISECONDS
+    atomic_uint n_full;  // times the parent found the ring full
+    atomic_uint_fast64_t write_ns_total;
+    atomic_uint_fast64_t write_ns_max;
+} raw_hid_writer_stats_t;
+
+#ifdef USE_IO_URING_LINUX
+typedef struct raw_hid_io_uring_t {
+    int fd;
+    void* sq_ring;
+    void* cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_tail_local;  // sqes before this are prepared, sqes before *sq_tail are submitted
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    uint64_t submit_generation;  // incremented by every submission
+    struct io_uring_sqe* last_write_sqe;  // for linking consecutive writes to the same device, NULL once any other sqe follows it
+    struct raw_hid_node_t* last_write_node;
+} raw_hid_io_uring_t;
+#endif
+
+#ifdef USE_HOTPLUG_EVENTS
+typedef struct raw_hid_sysfs_device_t {
+    char hid_name[32];  // like 0003:FEED:0000.0007, the last number is new every time a device is plugged in
+    bool is_raw_hid;
+    unsigned short vendor_id;
+    unsigned short product_id;
+} raw_hid_sysfs_device_t;
+#endif
+
+typedef struct raw_hid_shard_epoch_t {
+    _Alignas(CACHE_LINE_SIZE) atomic_uint_fast64_t epoch;  // only set by its shard
+} raw_hid_shard_epoch_t;
+
+typedef struct raw_hid_device_config_t {
+    unsigned short vendor_id;
+    unsigned short product_id;
+    float read_weight;
+    unsigned int queue_capacity;
+    int overflow_policy;
+} raw_hid_device_config_t;
+
 typedef struct raw_hid_node_t {
-    hid_device* device;
-    char* path;
+    raw_hid_handle_t device;
+    char path[MAX_DEVICE_PATH_LENGTH];
+    unsigned short vendor_id;
+    unsigned short product_id;
     int device_id;
     int is_in_enumeration;
-    atomic_int is_marked_for_unregistration;  // only set by child
+    int shard;  // router shard that reads from and writes to this device
+    float read_weight;
+    float read_deficit;  // only set by parent
+    unsigned int n_read_budgets_exhausted;  // only set by parent
+    unsigned int queue_capacity;
+    int overflow_policy;
+    struct raw_hid_message_t* held_message;  // only set by parent, waiting for room in a blocking queue
+    unsigned char held_destination_device_id;  // only set by parent
+#ifdef USE_EPOLL_LINUX
+    bool is_readable;  // only set by parent
+#endif
+#ifdef USE_READER_THREADS_POSIX
+    pthread_t reader_thread;
+    atomic_bool reader_termination_flag;
+    atomic_bool reader_is_done;  // set by the reader thread right before it exits
+#endif
+#ifdef USE_READ_RINGS
+    raw_hid_report_ring_t reader_ring;  // reader thread or io_uring completions -> parent
+#endif
+#ifdef USE_IO_URING_LINUX
+    unsigned char uring_read_buffer[QMK_RAW_HID_REPORT_SIZE];
+    unsigned char uring_write_buffers[IO_URING_WRITES_PER_DEVICE][QMK_RAW_HID_REPORT_SIZE + 1];
+    bool uring_read_in_flight;  // only set by parent
+    bool uring_read_failed;  // only set by parent
+    bool uring_read_cancelled;  // only set by parent
+    int uring_n_writes_in_flight;  // only set by parent
+    uint64_t uring_write_generation;  // only set by parent, submission that the last write went out with
+#endif
+#ifdef USE_WRITER_THREADS_POSIX
+    pthread_t writer_thread;
+    pthread_mutex_t writer_mutex;
+    pthread_cond_t writer_cond;
+    atomic_bool writer_termination_flag;
+    atomic_bool writer_is_done;  // set by the writer thread right before it exits
+    raw_hid_report_ring_t writer_ring;  // parent -> writer thread
+    raw_hid_writer_stats_t writer_stats;
+#endif
+    atomic_int is_marked_for_unregistration;  // set by child, or by parent after an I/O error
+    atomic_bool has_io_error;  // set by whichever thread saw a read or write fail
     atomic_int is_marked_for_deletion;  // only set by parent
     _Atomic(struct raw_hid_node_t*) next;  // only set by child
+    struct raw_hid_node_t* next_in_index;  // only used by child, next node in the same node_index bucket
+    uint64_t retire_epoch;  // only used by child, node_epoch right after the node was unlinked
+    struct raw_hid_node_t* next_retired;  // only used by child
 } raw_hid_node_t;
 
+typedef struct raw_hid_pool_t {
+    unsigned char* blocks;
+    void* free_list;  // each free block starts with a pointer to the next one
+    size_t block_size;
+    unsigned int n_blocks;
+    atomic_uint n_used;  // atomic so that stats can be read from other threads
+    atomic_uint max_used;
+} raw_hid_pool_t;
+
 typedef struct raw_hid_message_t {
-    unsigned char data[QMK_RAW_HID_REPORT_SIZE];
-    struct raw_hid_message_t* next;
+    uint64_t time_ns;  // when the hub read the report
+    int shard;  // whose pool the message came from
+    unsigned char report_id_and_data[QMK_RAW_HID_REPORT_SIZE + 1];  // read into MESSAGE_DATA(), written from here
 } raw_hid_message_t;
 
+typedef struct raw_hid_message_queue_t {
+    raw_hid_message_t** slots;  // device reports, allocated at registration, NULL otherwise
+    unsigned int head;
+    unsigned int depth;
+    unsigned int capacity;  // at most MESSAGE_QUEUE_CAPACITY
+    raw_hid_message_t* control_slots[CONTROL_QUEUE_CAPACITY];  // status reports from the hub
+    unsigned int control_head;
+    unsigned int control_depth;
+    unsigned int control_streak;  // control reports written in a row while device reports waited
+    int overflow_policy;
+    unsigned int high_water_mark;  // since the last stats
+    unsigned int n_dropped;  // since the last stats
+    unsigned int n_late;  // dropped by the queue delay policy since the last stats
+    unsigned int n_coalesced;  // since the last stats
+    uint64_t max_delay_ns;  // since the last stats
+#if QUEUE_DELAY_POLICY == QUEUE_DELAY_POLICY_CODEL
+    bool codel_is_dropping;
+    uint64_t codel_first_above_ns;  // when the delay may first count as too long, 0 while it's short
+    uint64_t codel_drop_next_ns;
+    unsigned int codel_count;  // drops since dropping started
+    unsigned int codel_last_count;
+#endif
+} raw_hid_message_queue_t;
+
+typedef enum idle_tier_t {
+    IDLE_TIER_HOT,
+    IDLE_TIER_WARM,
+    IDLE_TIER_COLD,
+    N_IDLE_TIERS
+} idle_tier_t;
+
 typedef struct raw_hid_message_counter_t {
     unsigned char origin_device_id;
     unsigned char destination_device_id;
     int count;
+    int n_dropped;  // by the destination's message queue
     struct raw_hid_message_counter_t* next;
 } raw_hid_message_counter_t;
 
@@ -121,23 +595,115 @@ typedef struct raw_hid_message_counter_t {
 // GLOBAL VARIABLES
 // ============================================================================
 
-atomic_bool main_loop_new_iteration_flag = false;
+const raw_hid_device_config_t device_configs[] = DEVICE_CONFIGS;
+#ifdef USE_COALESCING
+const int coalescing_key_offsets[] = COALESCING_KEY_OFFSETS;
+#endif
+
+// unlinked nodes are freed once every shard has been between iterations since, when it holds no node pointers
+atomic_uint_fast64_t node_epoch = 1;  // only set by child
+raw_hid_shard_epoch_t shard_epochs[ROUTER_SHARDS];  // node_epoch as each shard last saw it between iterations
+raw_hid_node_t* retired_nodes = NULL;  // only used by child, unlinked nodes waiting to be freed
 atomic_bool child_termination_flag = false;
 
 _Atomic(raw_hid_node_t*) raw_hid_nodes = NULL;  // only set by child
-bool registrations_changed = false;
+raw_hid_node_t* raw_hid_nodes_tail = NULL;  // only used by child
+raw_hid_node_t* node_index[NODE_INDEX_BUCKETS];  // only used by child, the same nodes as raw_hid_nodes hashed by path
+SHARD_LOCAL bool registrations_changed = false;
 int n_registered_devices = 0;
 int next_unassigned_device_id = 1;
 
 // initialized in main
-bool device_id_is_assigned[N_UNIQUE_DEVICE_IDS];
+atomic_bool device_id_is_assigned[N_UNIQUE_DEVICE_IDS];  // set under the registry lock, read by every shard
+_Atomic(raw_hid_node_t*) device_id_nodes[N_UNIQUE_DEVICE_IDS];
 unsigned char assigned_device_ids[MAX_REGISTERED_DEVICES];
-raw_hid_message_t* device_id_message_queue[N_UNIQUE_DEVICE_IDS];
-unsigned char buffer_report_id_and_data[QMK_RAW_HID_REPORT_SIZE + 1];
-unsigned char* buffer_data;
-uint64_t current_time_ms;
-uint64_t last_stats_time_ms;
-uint64_t last_message_time_ms;
+raw_hid_message_queue_t device_id_message_queue[N_UNIQUE_DEVICE_IDS];  // each queue is only used by its device's shard
+raw_hid_pool_t node_pool;  // only used by child
+raw_hid_pool_t message_queue_pool;  // protected by the registry lock
+raw_hid_pool_t message_pools[ROUTER_SHARDS];  // one per shard
+SHARD_LOCAL raw_hid_pool_t* message_pool;
+raw_hid_pool_t message_counter_pools[ROUTER_SHARDS];  // one per shard
+SHARD_LOCAL raw_hid_pool_t* message_counter_pool;
+#ifdef USE_ALLOCATION_CHECK_LINUX
+_Thread_local bool allocations_are_checked = false;  // set by router threads when their main loop starts
+char stdout_buffer[BUFSIZ];  // stdio would allocate its own on the first printf, which can come from a router thread
+#endif
+SHARD_LOCAL unsigned int n_shed_since_last_stats = 0;  // queued reports dropped for the memory budget
+SHARD_LOCAL int n_queued_messages = 0;
+SHARD_LOCAL raw_hid_message_t* spare_message = NULL;  // the next report is read into this
+SHARD_LOCAL uint64_t current_time_ms;
+SHARD_LOCAL uint64_t last_stats_time_ms;
+SHARD_LOCAL uint64_t last_message_time_ms;
+
+#ifdef USE_ROUTER_SHARDS
+SHARD_LOCAL int current_shard = 0;
+SHARD_LOCAL unsigned int seen_registration_generation = 0;
+atomic_uint registration_generation = 0;  // incremented whenever any shard changes registrations
+pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;  // protects the registration state above
+pthread_t shard_threads[ROUTER_SHARDS];  // shard 0 runs on the main thread
+atomic_bool shard_termination_flag = false;
+int n_shard_nodes[ROUTER_SHARDS];  // only set by child
+#endif
+
+#ifdef USE_BACKPRESSURE_NOTICES
+atomic_uint_fast64_t backpressure_notice_time_ms[N_UNIQUE_DEVICE_IDS];  // per origin
+SHARD_LOCAL unsigned int n_backpressure_notices_since_last_stats = 0;
+#endif
+
+#ifdef USE_MESSAGE_INBOXES
+// reports from threads other than the destination's own wait in the destination's inbox
+raw_hid_message_inbox_t message_inboxes[N_UNIQUE_DEVICE_IDS];  // consumed by the destination's shard
+SHARD_LOCAL unsigned int n_inbox_full_since_last_stats = 0;  // held reports retry once per iteration
+#endif
+
+#ifdef USE_EPOLL_LINUX
+int epoll_fd = -1;
+#endif
+#if defined(USE_EPOLL_LINUX) || defined(USE_IO_URING_LINUX)
+int wake_fd = -1;
+#endif
+
+#ifdef USE_HOTPLUG_EVENTS
+int hotplug_fd = -1;  // only used by child
+#endif
+#ifdef USE_HOTPLUG_EVENTS
+raw_hid_sysfs_device_t sysfs_devices[SYSFS_HIDRAW_CACHE_SIZE];  // only used by child, indexed by hidraw minor
+#endif
+
+#ifdef USE_IO_URING_LINUX
+raw_hid_io_uring_t uring = {.fd = -1};
+uint64_t uring_wake_count;  // target of the read on wake_fd
+bool uring_wake_read_in_flight = false;
+#endif
+
+#ifdef USE_READER_THREADS_POSIX
+pthread_mutex_t main_loop_wake_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t main_loop_wake_cond = PTHREAD_COND_INITIALIZER;
+bool main_loop_wake_pending = false;  // protected by main_loop_wake_mutex
+#endif
+
+#if defined(USE_WRITER_THREADS_POSIX) || defined(USE_HIDRAW_FD)
+SHARD_LOCAL bool writers_are_backlogged = false;  // set when a device couldn't take more writes during this iteration
+#endif
+SHARD_LOCAL bool reads_are_pending = false;  // set when a read budget ran out during this iteration
+
+// set from the command line
+bool low_latency_mode = false;
+int low_latency_main_cpu = LOW_LATENCY_MAIN_CPU;
+int low_latency_enumeration_cpu = LOW_LATENCY_ENUMERATION_CPU;
+int low_latency_priority = LOW_LATENCY_PRIORITY;
+
+#ifdef USE_PRECISION_TICK_POSIX
+SHARD_LOCAL uint64_t tick_period_ns;
+SHARD_LOCAL uint64_t next_tick_ns;
+#endif
+
+#ifdef USE_IDLE_TIERS
+SHARD_LOCAL idle_tier_t idle_tier = IDLE_TIER_WARM;
+SHARD_LOCAL int idle_tier_reports = 0;
+SHARD_LOCAL uint64_t idle_tier_window_start_ms = 0;  // when the first of idle_tier_reports arrived
+SHARD_LOCAL uint64_t idle_tier_last_update_ms;
+#endif
 
 // only for verbose
 bool verbose_basic = false;
@@ -145,8 +711,21 @@ bool verbose_stats = false;
 bool verbose_hub = false;
 bool verbose_device = false;
 bool verbose_discard = false;
-raw_hid_message_counter_t* message_counters = NULL;
-uint64_t iters_since_last_stats = 0;
+SHARD_LOCAL raw_hid_message_counter_t* message_counters = NULL;
+SHARD_LOCAL uint64_t iters_since_last_stats = 0;
+SHARD_LOCAL uint64_t tick_overruns_since_last_stats = 0;
+SHARD_LOCAL uint64_t ticks_missed_since_last_stats = 0;
+SHARD_LOCAL uint64_t tick_max_lateness_ns_since_last_stats = 0;
+SHARD_LOCAL uint64_t idle_tier_ms_since_last_stats[N_IDLE_TIERS] = {0};
+SHARD_LOCAL uint64_t idle_tier_transitions_since_last_stats = 0;
+uint64_t ingress_reports_since_last_stats = 0;
+uint64_t ingress_latency_ns_since_last_stats = 0;
+uint64_t ingress_max_latency_ns_since_last_stats = 0;
+SHARD_LOCAL uint32_t loop_period_histogram[LOOP_PERIOD_BUCKETS] = {0};
+uint64_t io_uring_enters_since_last_stats = 0;
+uint64_t io_uring_submissions_since_last_stats = 0;
+uint64_t io_uring_completions_since_last_stats = 0;
+SHARD_LOCAL uint64_t last_iteration_time_ns = 0;
 
 // ============================================================================
 // TIME
@@ -157,11 +736,21 @@ void update_current_time_ms(void) {
     current_time_ms = (uint64_t)GetTickCount64();
 #else
     struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
     current_time_ms = (uint64_t)(ts.tv_sec) * 1000 + (uint64_t)(ts.tv_nsec) / 1000000;
 #endif
 }
 
+#ifdef _WIN32
+uint64_t monotonic_time_ns(void) {
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000000 + (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000000 / frequency.QuadPart;
+}
+#endif
+
 #ifndef _WIN32
 void sleep_milliseconds(float milliseconds) {
     struct timespec req = {0};
@@ -172,191 +761,1844 @@ void sleep_milliseconds(float milliseconds) {
         req = rem;
     }
 }
-#endif
 
-// ============================================================================
-// VERBOSE UTILITIES
-// ============================================================================
+uint64_t monotonic_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)(ts.tv_sec) * 1000000000 + (uint64_t)(ts.tv_nsec);
+}
 
-void message_counter_increment(unsigned char origin_device_id, unsigned char destination_device_id) {
-    raw_hid_message_counter_t* current_counter = message_counters;
-    raw_hid_message_counter_t* previous_counter = NULL;
-    while (current_counter != NULL) {
-        if (current_counter->origin_device_id == origin_device_id && current_counter->destination_device_id == destination_device_id) {
-            current_counter->count++;
-            return;
-        }
-        previous_counter = current_counter;
-        current_counter = current_counter->next;
-    }
-    raw_hid_message_counter_t* new_counter = (raw_hid_message_counter_t*)malloc(sizeof(raw_hid_message_counter_t));
-    if (new_counter == NULL) {
-        return;
+void sleep_until_ns(uint64_t deadline_ns) {
+#ifdef __linux__
+    struct timespec ts;
+    ts.tv_sec = (time_t)(deadline_ns / 1000000000);
+    ts.tv_nsec = (long)(deadline_ns % 1000000000);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
     }
-    new_counter->origin_device_id = origin_device_id;
-    new_counter->destination_device_id = destination_device_id;
-    new_counter->count = 1;
-    new_counter->next = NULL;
-    if (message_counters == NULL) {
-        message_counters = new_counter;
-    } else {
-        previous_counter->next = new_counter;
+#else
+    // no absolute sleep on macos, so get as close as we can
+    uint64_t now_ns = monotonic_time_ns();
+    if (deadline_ns > now_ns) {
+        sleep_milliseconds((deadline_ns - now_ns) / 1e6);
     }
+#endif
 }
+#endif
 
-void message_counter_free_all(void) {
-    raw_hid_message_counter_t* current_counter = message_counters;
-    raw_hid_message_counter_t* next_counter = NULL;
-    while (current_counter != NULL) {
-        next_counter = current_counter->next;
-        free(current_counter);
-        current_counter = next_counter;
-    }
-    message_counters = NULL;
+// ============================================================================
+// TICK SCHEDULER (posix only)
+// ============================================================================
+
+#ifdef USE_PRECISION_TICK_POSIX
+uint64_t tick_align(uint64_t time_ns) {
+#ifdef USE_USB_FRAME_ALIGNMENT_POSIX
+    // move to the next frame boundary (as seen by the monotonic clock), then to the configured offset within it
+    uint64_t offset_ns = (uint64_t)USB_FRAME_OFFSET_MICROSECONDS * 1000 % USB_FRAME_NANOSECONDS;
+    uint64_t aligned_ns = (time_ns / USB_FRAME_NANOSECONDS) * USB_FRAME_NANOSECONDS + offset_ns;
+    return aligned_ns < time_ns ? aligned_ns + USB_FRAME_NANOSECONDS : aligned_ns;
+#else
+    return time_ns;
+#endif
 }
 
-void maybe_print_and_update_stats() {
-    if (!verbose_stats) {
-        return;
-    }
-    iters_since_last_stats++;
-    uint64_t delta_time_ms = current_time_ms - last_stats_time_ms;
-    if (delta_time_ms < STATS_INTERVAL_MS) {
-        return;
-    }
-    float delta_time_seconds = delta_time_ms / 1000.0;
-    raw_hid_message_counter_t* current_counter = message_counters;
-    printf("Main loop ran %llu times (%.2f per second).\n", (unsigned long long)iters_since_last_stats, iters_since_last_stats / delta_time_seconds);
-    printf("Message counts:\n");
-    while (current_counter != NULL) {
-        printf("  [0x%02hx -> 0x%02hx]: %4d (%7.2f per second).\n", current_counter->origin_device_id, current_counter->destination_device_id, current_counter->count, current_counter->count / delta_time_seconds);
-        current_counter = current_counter->next;
-    }
-    message_counter_free_all();
-    last_stats_time_ms = current_time_ms;
-    iters_since_last_stats = 0;
+void tick_scheduler_reset(void) {
+    // start counting ticks from now, e.g. after a stretch without sleeping
+    next_tick_ns = tick_align(monotonic_time_ns() + tick_period_ns);
 }
 
-void print_device_info(struct hid_device_info* device) {
-    printf("  Path:         %s\n", 		device->path);
-    printf("  Manufacturer: %ls\n", 	device->manufacturer_string);
-    printf("  Product:      %ls\n", 	device->product_string);
-    printf("  Serial:       %ls\n", 	device->serial_number);
-    printf("  Release:      %hx\n", 	device->release_number);
-    printf("  Vendor ID:    0x%04hx\n",	device->vendor_id);
-    printf("  Product ID:   0x%04hx\n", device->product_id);
-    printf("  Usage Page:   0x%04hx\n", device->usage_page);
-    printf("  Usage:        0x%02hx\n", device->usage);
+void tick_scheduler_init(void) {
+    tick_period_ns = (uint64_t)(SLEEP_MILLISECONDS_POSIX * 1e6);
+#ifdef USE_USB_FRAME_ALIGNMENT_POSIX
+    // a whole number of frames keeps the phase between ticks and frames constant
+    tick_period_ns = ((tick_period_ns + USB_FRAME_NANOSECONDS - 1) / USB_FRAME_NANOSECONDS) * USB_FRAME_NANOSECONDS;
+#endif
+    tick_scheduler_reset();
 }
 
-void print_buffer(void) {
-    for (size_t i = 0; i < QMK_RAW_HID_REPORT_SIZE; i++) {
-        printf("%02X ", buffer_data[i]);
+void tick_scheduler_wait(void) {
+    uint64_t now_ns = monotonic_time_ns();
+    if (now_ns >= next_tick_ns) {
+        // the last iteration ran past its deadline, so skip the ticks we missed without losing phase
+        uint64_t lateness_ns = now_ns - next_tick_ns;
+        uint64_t n_missed_ticks = lateness_ns / tick_period_ns + 1;
+        next_tick_ns += n_missed_ticks * tick_period_ns;
+        tick_overruns_since_last_stats++;
+        ticks_missed_since_last_stats += n_missed_ticks;
+        if (lateness_ns > tick_max_lateness_ns_since_last_stats) {
+            tick_max_lateness_ns_since_last_stats = lateness_ns;
+        }
     }
-    printf("\n");
+    sleep_until_ns(next_tick_ns);
+    next_tick_ns += tick_period_ns;
+}
+#endif
+
+#ifndef _WIN32
+void sleep_one_tick(void) {
+#ifdef USE_PRECISION_TICK_POSIX
+    tick_scheduler_wait();
+#else
+    sleep_milliseconds(SLEEP_MILLISECONDS_POSIX);
+#endif
 }
+#endif
 
 // ============================================================================
-// raw_hid_node_t MEMORY MANAGEMENT (child only)
+// IDLE TIERS
 // ============================================================================
 
-raw_hid_node_t* raw_hid_node_new(hid_device* device, const char* path, raw_hid_node_t* previous_node) {
-    raw_hid_node_t* new_node = (raw_hid_node_t*)malloc(sizeof(raw_hid_node_t));
-    if (new_node == NULL) {
-        return NULL;
-    }
-    new_node->device = device;
-    new_node->path = strdup(path);
-    if (new_node->path == NULL) {
-        free(new_node);
-        return NULL;
-    }
-    new_node->device_id = DEVICE_ID_UNASSIGNED;
-    new_node->is_in_enumeration = true;
-    atomic_store(&(new_node->is_marked_for_unregistration), false);
-    atomic_store(&(new_node->is_marked_for_deletion), false);
-    atomic_store(&(new_node->next), NULL);
-    if (previous_node == NULL) {
-        atomic_store(&raw_hid_nodes, new_node);
-    } else {
-        atomic_store(&(previous_node->next), new_node);
-    }
-    return new_node;
+#ifdef USE_IDLE_TIERS
+const char* idle_tier_names[N_IDLE_TIERS] = {"hot", "warm", "cold"};
+
+void idle_tier_enter(idle_tier_t tier) {
+    idle_tier = tier;
+    idle_tier_reports = 0;
+    idle_tier_transitions_since_last_stats++;
 }
 
-void raw_hid_node_free(raw_hid_node_t* node) {
-    if (node == NULL) {
-        return;
+void idle_tiers_note_activity(void) {
+    // promotion needs a few reports so that a lone ping doesn't wake everything up
+    last_message_time_ms = current_time_ms;
+    if (idle_tier != IDLE_TIER_HOT) {
+        if (idle_tier_reports == 0 || current_time_ms - idle_tier_window_start_ms >= IDLE_PROMOTE_WINDOW_MILLISECONDS) {
+            // reports that are too far apart don't add up
+            idle_tier_reports = 0;
+            idle_tier_window_start_ms = current_time_ms;
+        }
+        idle_tier_reports++;
+        if (idle_tier_reports >= IDLE_PROMOTE_REPORTS) {
+            idle_tier_enter(idle_tier - 1);
+        }
     }
-    hid_close(node->device);
-    free(node->path);
-    free(node);
 }
 
-void raw_hid_node_free_all(void) {
-    raw_hid_node_t* current_node = atomic_load(&raw_hid_nodes);
-    raw_hid_node_t* next_node = NULL;
-    while (current_node != NULL) {
-        next_node = atomic_load(&current_node->next);
-        raw_hid_node_free(current_node);
-        current_node = next_node;
+void idle_tiers_update(void) {
+    // demotion needs a stretch without reports, which gives hysteresis against the promotion rule
+    idle_tier_ms_since_last_stats[idle_tier] += current_time_ms - idle_tier_last_update_ms;
+    idle_tier_last_update_ms = current_time_ms;
+    uint64_t idle_time_ms = current_time_ms - last_message_time_ms;
+    if (idle_tier == IDLE_TIER_HOT && idle_time_ms >= IDLE_WARM_AFTER_MILLISECONDS) {
+        idle_tier_enter(IDLE_TIER_WARM);
+    } else if (idle_tier == IDLE_TIER_WARM && idle_time_ms >= IDLE_COLD_AFTER_MILLISECONDS) {
+        idle_tier_enter(IDLE_TIER_COLD);
     }
-    atomic_store(&raw_hid_nodes, NULL);
 }
+#endif
 
 // ============================================================================
-// HID ENUMERATION (child only)
+// ALLOCATION CHECK (linux only, debug only)
 // ============================================================================
 
-int handle_raw_hid_device_found(const char* path) {
-    // returns 1 if a new device was opened, 0 if an existing open device was found, -1 for error
+#ifdef USE_ALLOCATION_CHECK_LINUX
+// glibc's allocator under its own names, so that the definitions below can stand in for it everywhere
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n_members, size_t size);
+void* __libc_realloc(void* pointer, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void* pointer);
+
+void allocation_check(void) {
+    if (allocations_are_checked) {
+        // printf could allocate
+        static const char message[] = "Heap allocation on a router thread after startup.\n";
+        write(STDERR_FILENO, message, sizeof(message) - 1);
+        abort();
+    }
+}
+
+void* malloc(size_t size) {
+    allocation_check();
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n_members, size_t size) {
+    allocation_check();
+    return __libc_calloc(n_members, size);
+}
+
+void* realloc(void* pointer, size_t size) {
+    allocation_check();
+    return __libc_realloc(pointer, size);
+}
+
+void* memalign(size_t alignment, size_t size) {
+    allocation_check();
+    return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    allocation_check();
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void** pointer, size_t alignment, size_t size) {
+    allocation_check();
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void* result = __libc_memalign(alignment, size);
+    if (result == NULL) {
+        return ENOMEM;
+    }
+    *pointer = result;
+    return 0;
+}
+
+void free(void* pointer) {
+    __libc_free(pointer);
+}
+#endif
+
+bool allocation_check_suspend(void) {
+    // for calls into libraries that allocate on their error paths, like hidapi's error strings when a device goes away
+#ifdef USE_ALLOCATION_CHECK_LINUX
+    bool allocations_were_checked = allocations_are_checked;
+    allocations_are_checked = false;
+    return allocations_were_checked;
+#else
+    return false;
+#endif
+}
+
+void allocation_check_resume(bool allocations_were_checked) {
+#ifdef USE_ALLOCATION_CHECK_LINUX
+    allocations_are_checked = allocations_were_checked;
+#else
+    (void)allocations_were_checked;
+#endif
+}
+
+// ============================================================================
+// POOLS
+// ============================================================================
+
+size_t pool_block_size(size_t size) {
+    // blocks have to hold the free list pointer and keep the next block aligned
+    size_t alignment = sizeof(max_align_t);
+    if (size < sizeof(void*)) {
+        size = sizeof(void*);
+    }
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+bool pool_init(raw_hid_pool_t* pool, size_t block_size, unsigned int n_blocks) {
+    // returns false if out of memory
+    pool->block_size = pool_block_size(block_size);
+    pool->n_blocks = n_blocks;
+    atomic_store(&(pool->n_used), 0);
+    atomic_store(&(pool->max_used), 0);
+    pool->free_list = NULL;
+    pool->blocks = malloc(pool->block_size * n_blocks);
+    if (pool->blocks == NULL) {
+        return false;
+    }
+    for (unsigned int i = n_blocks; i > 0; i--) {
+        void* block = pool->blocks + (i - 1) * pool->block_size;
+        *(void**)block = pool->free_list;
+        pool->free_list = block;
+    }
+    return true;
+}
+
+void pool_free_all(raw_hid_pool_t* pool) {
+    // only once nothing uses the blocks anymore
+    free(pool->blocks);
+    memset(pool, 0, sizeof(*pool));
+}
+
+void* pool_get(raw_hid_pool_t* pool) {
+    // returns NULL if the pool is empty
+    void* block = pool->free_list;
+    if (block == NULL) {
+        return NULL;
+    }
+    pool->free_list = *(void**)block;
+    unsigned int n_used = atomic_fetch_add(&(pool->n_used), 1) + 1;
+    if (n_used > atomic_load(&(pool->max_used))) {
+        atomic_store(&(pool->max_used), n_used);
+    }
+    return block;
+}
+
+void pool_put(raw_hid_pool_t* pool, void* block) {
+    if (block == NULL) {
+        return;
+    }
+    *(void**)block = pool->free_list;
+    pool->free_list = block;
+    atomic_fetch_sub(&(pool->n_used), 1);
+}
+
+size_t pool_bytes_reserved(raw_hid_pool_t* pool) {
+    return pool->block_size * pool->n_blocks;
+}
+
+size_t pool_bytes_used(raw_hid_pool_t* pool) {
+    return pool->block_size * atomic_load(&(pool->n_used));
+}
+
+size_t node_ring_bytes(void) {
+    // the report rings live inside every node
+    size_t n_bytes = 0;
+#ifdef USE_READ_RINGS
+    n_bytes += sizeof(raw_hid_report_ring_t);
+#endif
+#ifdef USE_WRITER_THREADS_POSIX
+    n_bytes += sizeof(raw_hid_report_ring_t);
+#endif
+    return n_bytes;
+}
+
+size_t static_table_bytes(void) {
+    // the per device ID tables and per shard histograms that don't come from pools
+    size_t n_bytes = sizeof(device_id_message_queue) + sizeof(loop_period_histogram) * ROUTER_SHARDS;
+#ifdef USE_MESSAGE_INBOXES
+    n_bytes += sizeof(message_inboxes);
+#endif
+    return n_bytes;
+}
+
+bool pools_init(void) {
+    // returns false if out of memory or the memory budget is too small
+    if (!pool_init(&node_pool, sizeof(raw_hid_node_t), MAX_OPEN_DEVICES)) {
+        return false;
+    }
+    if (!pool_init(&message_queue_pool, MESSAGE_QUEUE_CAPACITY * sizeof(raw_hid_message_t*), MAX_REGISTERED_DEVICES)) {
+        return false;
+    }
+    size_t n_bytes_reserved = static_table_bytes() + pool_bytes_reserved(&node_pool) + pool_bytes_reserved(&message_queue_pool);
+    for (int shard = 0; shard < ROUTER_SHARDS; shard++) {
+        // enough for every pair of registered devices and the hub
+        if (!pool_init(&message_counter_pools[shard], sizeof(raw_hid_message_counter_t), (MAX_REGISTERED_DEVICES + 1) * (MAX_REGISTERED_DEVICES + 1))) {
+            return false;
+        }
+        n_bytes_reserved += pool_bytes_reserved(&message_counter_pools[shard]);
+    }
+    // enough to fill every queue and control lane, hold a report for every device and read one more
+    size_t n_messages = MAX_REGISTERED_DEVICES * (MESSAGE_QUEUE_CAPACITY + CONTROL_QUEUE_CAPACITY) + MESSAGE_POOL_RESERVE;
+#if MEMORY_BUDGET_KILOBYTES > 0
+    // messages get whatever the budget leaves, split evenly between the shards
+    size_t budget = (size_t)MEMORY_BUDGET_KILOBYTES * 1024;
+    size_t message_block_size = pool_block_size(sizeof(raw_hid_message_t));
+    size_t n_affordable_messages = n_bytes_reserved < budget ? (budget - n_bytes_reserved) / message_block_size / ROUTER_SHARDS : 0;
+    if (n_affordable_messages <= MESSAGE_POOL_RESERVE) {
+        printf("Memory budget of %d KB is too small, the tables and pools need at least %zu KB.\n", MEMORY_BUDGET_KILOBYTES, (n_bytes_reserved + (MESSAGE_POOL_RESERVE + 1) * message_block_size * ROUTER_SHARDS + 1023) / 1024);
+        return false;
+    }
+    if (n_affordable_messages < n_messages) {
+        n_messages = n_affordable_messages;
+    }
+#endif
+    for (int shard = 0; shard < ROUTER_SHARDS; shard++) {
+        if (!pool_init(&message_pools[shard], sizeof(raw_hid_message_t), n_messages)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void pools_free_all(void) {
+    pool_free_all(&node_pool);
+    pool_free_all(&message_queue_pool);
+    for (int shard = 0; shard < ROUTER_SHARDS; shard++) {
+        pool_free_all(&message_pools[shard]);
+        pool_free_all(&message_counter_pools[shard]);
+    }
+}
+
+// ============================================================================
+// ROUTER SHARDS
+// ============================================================================
+
+bool node_is_in_current_shard(raw_hid_node_t* node) {
+#ifdef USE_ROUTER_SHARDS
+    return node != NULL && node->shard == current_shard;
+#else
+    return node != NULL;
+#endif
+}
+
+#ifdef USE_ROUTER_SHARDS
+void stop_shards(void) {
+    // called from the main thread, which is shard 0
+    atomic_store(&shard_termination_flag, true);
+    for (int shard = 1; shard < ROUTER_SHARDS; shard++) {
+        pthread_join(shard_threads[shard], NULL);
+    }
+}
+#endif
+
+// ============================================================================
+// VERBOSE UTILITIES
+// ============================================================================
+
+raw_hid_message_counter_t* message_counter_find(unsigned char origin_device_id, unsigned char destination_device_id) {
+    // returns NULL if the pool is empty
+    raw_hid_message_counter_t* current_counter = message_counters;
+    raw_hid_message_counter_t* previous_counter = NULL;
+    while (current_counter != NULL) {
+        if (current_counter->origin_device_id == origin_device_id && current_counter->destination_device_id == destination_device_id) {
+            return current_counter;
+        }
+        previous_counter = current_counter;
+        current_counter = current_counter->next;
+    }
+    raw_hid_message_counter_t* new_counter = (raw_hid_message_counter_t*)pool_get(message_counter_pool);
+    if (new_counter == NULL) {
+        return NULL;
+    }
+    new_counter->origin_device_id = origin_device_id;
+    new_counter->destination_device_id = destination_device_id;
+    new_counter->count = 0;
+    new_counter->n_dropped = 0;
+    new_counter->next = NULL;
+    if (message_counters == NULL) {
+        message_counters = new_counter;
+    } else {
+        previous_counter->next = new_counter;
+    }
+    return new_counter;
+}
+
+void message_counter_increment(unsigned char origin_device_id, unsigned char destination_device_id) {
+    raw_hid_message_counter_t* counter = message_counter_find(origin_device_id, destination_device_id);
+    if (counter != NULL) {
+        counter->count++;
+    }
+}
+
+void message_counter_increment_dropped(unsigned char origin_device_id, unsigned char destination_device_id) {
+    raw_hid_message_counter_t* counter = message_counter_find(origin_device_id, destination_device_id);
+    if (counter != NULL) {
+        counter->n_dropped++;
+    }
+}
+
+void message_counter_free_all(void) {
+    raw_hid_message_counter_t* current_counter = message_counters;
+    raw_hid_message_counter_t* next_counter = NULL;
+    while (current_counter != NULL) {
+        next_counter = current_counter->next;
+        pool_put(message_counter_pool, current_counter);
+        current_counter = next_counter;
+    }
+    message_counters = NULL;
+}
+
+void loop_period_record(void) {
+    uint64_t now_ns = monotonic_time_ns();
+    if (last_iteration_time_ns != 0) {
+        uint64_t period_us = (now_ns - last_iteration_time_ns) / 1000;
+        size_t bucket;
+        if (period_us < LOOP_PERIOD_FINE_BUCKETS) {
+            bucket = period_us;
+        } else if (period_us < LOOP_PERIOD_FINE_BUCKETS + (uint64_t)LOOP_PERIOD_COARSE_BUCKETS * 100) {
+            bucket = LOOP_PERIOD_FINE_BUCKETS + (period_us - LOOP_PERIOD_FINE_BUCKETS) / 100;
+        } else {
+            bucket = LOOP_PERIOD_BUCKETS - 1;
+        }
+        loop_period_histogram[bucket]++;
+    }
+    last_iteration_time_ns = now_ns;
+}
+
+float loop_period_bucket_ms(size_t bucket) {
+    // upper edge of the bucket
+    if (bucket < LOOP_PERIOD_FINE_BUCKETS) {
+        return (bucket + 1) / 1000.0;
+    }
+    return (LOOP_PERIOD_FINE_BUCKETS + (bucket - LOOP_PERIOD_FINE_BUCKETS + 1) * 100) / 1000.0;
+}
+
+void loop_period_print_and_reset(void) {
+    const float percentiles[] = {50, 90, 99, 99.9, 100};
+    const char* percentile_names[] = {"p50", "p90", "p99", "p99.9", "max"};
+    uint64_t n_periods = 0;
+    for (size_t bucket = 0; bucket < LOOP_PERIOD_BUCKETS; bucket++) {
+        n_periods += loop_period_histogram[bucket];
+    }
+    if (n_periods == 0) {
+        return;
+    }
+    printf("Loop period:");
+    uint64_t n_seen = 0;
+    size_t bucket = 0;
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+        uint64_t n_needed = (uint64_t)(n_periods * percentiles[i] / 100);
+        if (n_needed > n_periods) {
+            // float rounding can push max past the last period, which would walk off the histogram
+            n_needed = n_periods;
+        }
+        if (n_needed == 0) {
+            n_needed = 1;
+        }
+        while (n_seen + loop_period_histogram[bucket] < n_needed) {
+            n_seen += loop_period_histogram[bucket];
+            bucket++;
+        }
+        if (bucket == LOOP_PERIOD_BUCKETS - 1) {
+            printf(" %s >%.3f ms", percentile_names[i], loop_period_bucket_ms(bucket - 1));
+        } else {
+            printf(" %s %.3f ms", percentile_names[i], loop_period_bucket_ms(bucket));
+        }
+    }
+    printf(".\n");
+    memset(loop_period_histogram, 0, sizeof(loop_period_histogram));
+}
+
+void print_memory_usage(void) {
+    // what every part of the hub holds out of what it reserved, the paths and rings live inside the nodes,
+    // and the static tables are always held in full
+    size_t n_path_bytes_used = atomic_load(&(node_pool.n_used)) * MAX_DEVICE_PATH_LENGTH;
+    size_t n_path_bytes_reserved = node_pool.n_blocks * MAX_DEVICE_PATH_LENGTH;
+    size_t n_ring_bytes_used = atomic_load(&(node_pool.n_used)) * node_ring_bytes();
+    size_t n_ring_bytes_reserved = node_pool.n_blocks * node_ring_bytes();
+    size_t n_table_bytes = static_table_bytes();
+    size_t n_message_bytes_used = 0;
+    size_t n_message_bytes_reserved = 0;
+    size_t n_stats_bytes_used = 0;
+    size_t n_stats_bytes_reserved = 0;
+    for (int shard = 0; shard < ROUTER_SHARDS; shard++) {
+        n_message_bytes_used += pool_bytes_used(&message_pools[shard]);
+        n_message_bytes_reserved += pool_bytes_reserved(&message_pools[shard]);
+        n_stats_bytes_used += pool_bytes_used(&message_counter_pools[shard]);
+        n_stats_bytes_reserved += pool_bytes_reserved(&message_counter_pools[shard]);
+    }
+    size_t n_bytes_used = n_table_bytes + pool_bytes_used(&node_pool) + pool_bytes_used(&message_queue_pool) + n_message_bytes_used + n_stats_bytes_used;
+    size_t n_bytes_reserved = n_table_bytes + pool_bytes_reserved(&node_pool) + pool_bytes_reserved(&message_queue_pool) + n_message_bytes_reserved + n_stats_bytes_reserved;
+    printf("Memory: tables %.1f KB, nodes %.1f/%.1f KB, paths %.1f/%.1f KB, rings %.1f/%.1f KB, queues %.1f/%.1f KB, messages %.1f/%.1f KB, stats %.1f/%.1f KB, total %.1f/%.1f KB", n_table_bytes / 1024.0, (pool_bytes_used(&node_pool) - n_path_bytes_used - n_ring_bytes_used) / 1024.0, (pool_bytes_reserved(&node_pool) - n_path_bytes_reserved - n_ring_bytes_reserved) / 1024.0, n_path_bytes_used / 1024.0, n_path_bytes_reserved / 1024.0, n_ring_bytes_used / 1024.0, n_ring_bytes_reserved / 1024.0, pool_bytes_used(&message_queue_pool) / 1024.0, pool_bytes_reserved(&message_queue_pool) / 1024.0, n_message_bytes_used / 1024.0, n_message_bytes_reserved / 1024.0, n_stats_bytes_used / 1024.0, n_stats_bytes_reserved / 1024.0, n_bytes_used / 1024.0, n_bytes_reserved / 1024.0);
+#if MEMORY_BUDGET_KILOBYTES > 0
+    printf(" (budget %d KB), %u reports shed.\n", MEMORY_BUDGET_KILOBYTES, n_shed_since_last_stats);
+#else
+    printf(".\n");
+#endif
+    n_shed_since_last_stats = 0;
+}
+
+void maybe_print_and_update_stats() {
+    if (!verbose_stats) {
+        return;
+    }
+    iters_since_last_stats++;
+    loop_period_record();
+    uint64_t delta_time_ms = current_time_ms - last_stats_time_ms;
+    if (delta_time_ms < STATS_INTERVAL_MS) {
+        return;
+    }
+    float delta_time_seconds = delta_time_ms / 1000.0;
+    raw_hid_message_counter_t* current_counter = message_counters;
+#ifdef USE_ROUTER_SHARDS
+    // keep the shards from printing over each other
+    flockfile(stdout);
+    printf("Shard %d:\n", current_shard);
+#endif
+#ifdef USE_BACKPRESSURE_NOTICES
+    printf("Backpressure notices: %u sent.\n", n_backpressure_notices_since_last_stats);
+    n_backpressure_notices_since_last_stats = 0;
+#endif
+#ifdef USE_MESSAGE_INBOXES
+    printf("Message inboxes: %u pushes found an inbox full.\n", n_inbox_full_since_last_stats);
+    n_inbox_full_since_last_stats = 0;
+#endif
+    printf("Main loop ran %llu times (%.2f per second).\n", (unsigned long long)iters_since_last_stats, iters_since_last_stats / delta_time_seconds);
+    loop_period_print_and_reset();
+#ifdef USE_PRECISION_TICK_POSIX
+    printf("Tick scheduler: %llu overruns, %llu ticks missed, max lateness %.3f ms.\n", (unsigned long long)tick_overruns_since_last_stats, (unsigned long long)ticks_missed_since_last_stats, tick_max_lateness_ns_since_last_stats / 1e6);
+#endif
+#ifdef USE_IDLE_TIERS
+    printf("Idle tiers (%llu transitions):", (unsigned long long)idle_tier_transitions_since_last_stats);
+    for (int tier = 0; tier < N_IDLE_TIERS; tier++) {
+        printf(" %s %.1f%%", idle_tier_names[tier], 100.0 * idle_tier_ms_since_last_stats[tier] / delta_time_ms);
+        idle_tier_ms_since_last_stats[tier] = 0;
+    }
+    printf(".\n");
+    idle_tier_transitions_since_last_stats = 0;
+#endif
+#ifdef USE_READ_RINGS
+    // the reader thread or io_uring completion found the ring full
+    unsigned int n_dropped = 0;
     raw_hid_node_t* current_node = atomic_load(&raw_hid_nodes);
-    raw_hid_node_t* previous_node = NULL;
     while (current_node != NULL) {
-        if ((strcmp(current_node->path, path) == 0) && (!atomic_load(&(current_node->is_marked_for_unregistration)))) {
-            current_node->is_in_enumeration = true;
-            return 0;
-        }
-        previous_node = current_node;
+        n_dropped += atomic_exchange(&(current_node->reader_ring.n_dropped), 0);
         current_node = atomic_load(&(current_node->next));
     }
-    hid_device* device = hid_open_path(path);
-    if (device == NULL) {
+#    ifdef USE_READER_THREADS_POSIX
+    printf("Reader threads: %u reports dropped.\n", n_dropped);
+#    else
+    printf("io_uring reads: %u reports dropped.\n", n_dropped);
+#    endif
+#endif
+#ifdef USE_IO_URING_LINUX
+    printf("io_uring: %llu syscalls, %llu submissions, %llu completions", (unsigned long long)io_uring_enters_since_last_stats, (unsigned long long)io_uring_submissions_since_last_stats, (unsigned long long)io_uring_completions_since_last_stats);
+    if (ingress_reports_since_last_stats > 0) {
+        printf(" (%.3f syscalls per report read)", (double)io_uring_enters_since_last_stats / ingress_reports_since_last_stats);
+    }
+    printf(".\n");
+    io_uring_enters_since_last_stats = 0;
+    io_uring_submissions_since_last_stats = 0;
+    io_uring_completions_since_last_stats = 0;
+#endif
+#ifdef USE_READ_RINGS
+    if (ingress_reports_since_last_stats > 0) {
+        printf("Ingress latency: %.3f ms average, %.3f ms max.\n", ingress_latency_ns_since_last_stats / 1e6 / ingress_reports_since_last_stats, ingress_max_latency_ns_since_last_stats / 1e6);
+    }
+    ingress_reports_since_last_stats = 0;
+    ingress_latency_ns_since_last_stats = 0;
+    ingress_max_latency_ns_since_last_stats = 0;
+#endif
+    printf("Pools: %u/%u nodes (max %u), %u/%u message queues (max %u), %u/%u messages (max %u), %u/%u counters (max %u).\n", atomic_load(&(node_pool.n_used)), node_pool.n_blocks, atomic_load(&(node_pool.max_used)), atomic_load(&(message_queue_pool.n_used)), message_queue_pool.n_blocks, atomic_load(&(message_queue_pool.max_used)), atomic_load(&(message_pool->n_used)), message_pool->n_blocks, atomic_load(&(message_pool->max_used)), atomic_load(&(message_counter_pool->n_used)), message_counter_pool->n_blocks, atomic_load(&(message_counter_pool->max_used)));
+    print_memory_usage();
+    printf("Message queues:\n");
+    raw_hid_node_t* queue_node = atomic_load(&raw_hid_nodes);
+    while (queue_node != NULL) {
+        if (node_is_in_current_shard(queue_node) && DEVICE_ID_IS_VALID(queue_node->device_id)) {
+            raw_hid_message_queue_t* queue = &(device_id_message_queue[queue_node->device_id]);
+            printf("  [0x%02hx]: %2u/%u queued (%u control), high water mark %2u, %u dropped, %u late, %u coalesced, max delay %.3f ms.\n", queue_node->device_id, queue->depth, queue->capacity, queue->control_depth, queue->high_water_mark, queue->n_dropped, queue->n_late, queue->n_coalesced, queue->max_delay_ns / 1e6);
+            queue->high_water_mark = queue->depth;
+            queue->n_dropped = 0;
+            queue->n_late = 0;
+            queue->n_coalesced = 0;
+            queue->max_delay_ns = 0;
+        }
+        queue_node = atomic_load(&(queue_node->next));
+    }
+#if READ_SCHEDULER != READ_SCHEDULER_DRAIN
+    printf("Read budgets exhausted:\n");
+    raw_hid_node_t* budget_node = atomic_load(&raw_hid_nodes);
+    while (budget_node != NULL) {
+        if (node_is_in_current_shard(budget_node)) {
+            printf("  [0x%02hx]: %4u (weight %.2f).\n", budget_node->device_id, budget_node->n_read_budgets_exhausted, budget_node->read_weight);
+            budget_node->n_read_budgets_exhausted = 0;
+        }
+        budget_node = atomic_load(&(budget_node->next));
+    }
+#endif
+#ifdef USE_WRITER_THREADS_POSIX
+    printf("Writer threads:\n");
+    raw_hid_node_t* writer_node = atomic_load(&raw_hid_nodes);
+    while (writer_node != NULL) {
+        if (node_is_in_current_shard(writer_node)) {
+            raw_hid_writer_stats_t* writer_stats = &(writer_node->writer_stats);
+            unsigned int n_writes = atomic_exchange(&(writer_stats->n_writes), 0);
+            uint64_t write_ns_total = atomic_exchange(&(writer_stats->write_ns_total), 0);
+            printf("  [0x%02hx]: %4u writes (%.3f ms average, %.3f ms max), %u slow, %u expired, %u times full.\n", writer_node->device_id, n_writes, n_writes > 0 ? write_ns_total / 1e6 / n_writes : 0.0, atomic_exchange(&(writer_stats->write_ns_max), 0) / 1e6, atomic_exchange(&(writer_stats->n_slow), 0), atomic_exchange(&(writer_stats->n_expired), 0), atomic_exchange(&(writer_stats->n_full), 0));
+        }
+        writer_node = atomic_load(&(writer_node->next));
+    }
+#endif
+    printf("Message counts:\n");
+    while (current_counter != NULL) {
+        printf("  [0x%02hx -> 0x%02hx]: %4d (%7.2f per second), %d dropped.\n", current_counter->origin_device_id, current_counter->destination_device_id, current_counter->count, current_counter->count / delta_time_seconds, current_counter->n_dropped);
+        current_counter = current_counter->next;
+    }
+#ifdef USE_ROUTER_SHARDS
+    funlockfile(stdout);
+#endif
+    message_counter_free_all();
+    last_stats_time_ms = current_time_ms;
+    iters_since_last_stats = 0;
+    tick_overruns_since_last_stats = 0;
+    ticks_missed_since_last_stats = 0;
+    tick_max_lateness_ns_since_last_stats = 0;
+}
+
+void print_device_info(struct hid_device_info* device) {
+    printf("  Path:         %s\n", 		device->path);
+    printf("  Manufacturer: %ls\n", 	device->manufacturer_string);
+    printf("  Product:      %ls\n", 	device->product_string);
+    printf("  Serial:       %ls\n", 	device->serial_number);
+    printf("  Release:      %hx\n", 	device->release_number);
+    printf("  Vendor ID:    0x%04hx\n",	device->vendor_id);
+    printf("  Product ID:   0x%04hx\n", device->product_id);
+    printf("  Usage Page:   0x%04hx\n", device->usage_page);
+    printf("  Usage:        0x%02hx\n", device->usage);
+}
+
+void print_buffer(const unsigned char* data) {
+    for (size_t i = 0; i < QMK_RAW_HID_REPORT_SIZE; i++) {
+        printf("%02X ", data[i]);
+    }
+    printf("\n");
+}
+
+// ============================================================================
+// RAW HID I/O
+// ============================================================================
+
+raw_hid_handle_t raw_hid_open(const char* path) {
+#if defined(USE_IO_URING_LINUX)
+    // io_uring fails reads on nonblocking files instead of waiting for data
+    return open(path, O_RDWR | O_CLOEXEC);
+#elif defined(USE_HIDRAW_FD)
+    // the hidraw backend of hidapi does the same thing, but hides the file descriptor
+    return open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+#else
+    hid_device* device = hid_open_path(path);
+    if (device != NULL) {
+        hid_set_nonblocking(device, 1);  // set hid_read() to be nonblocking
+    }
+    return device;
+#endif
+}
+
+void raw_hid_close(raw_hid_handle_t device) {
+#ifdef USE_HIDRAW_FD
+    close(device);
+#else
+    hid_close(device);
+#endif
+}
+
+int raw_hid_read(raw_hid_handle_t device, unsigned char* data) {
+    // returns the number of bytes read, 0 if nothing was available, -1 for error
+#ifdef USE_HIDRAW_FD
+    ssize_t bytes_read = read(device, data, QMK_RAW_HID_REPORT_SIZE);
+    if (bytes_read < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    }
+    return (int)bytes_read;
+#else
+    bool allocations_were_checked = allocation_check_suspend();
+    int bytes_read = hid_read(device, data, QMK_RAW_HID_REPORT_SIZE);
+    allocation_check_resume(allocations_were_checked);
+    return bytes_read;
+#endif
+}
+
+int raw_hid_read_timeout(raw_hid_handle_t device, unsigned char* data, int milliseconds) {
+    // returns the number of bytes read, 0 if nothing arrived in time, -1 for error
+#ifdef USE_HIDRAW_FD
+    struct pollfd pfd = {.fd = device, .events = POLLIN};
+    int result = poll(&pfd, 1, milliseconds);
+    if (result <= 0) {
+        return (result == 0 || errno == EINTR) ? 0 : -1;
+    }
+    return raw_hid_read(device, data);
+#else
+    return hid_read_timeout(device, data, QMK_RAW_HID_REPORT_SIZE, milliseconds);
+#endif
+}
+
+int raw_hid_write(raw_hid_handle_t device, const unsigned char* report_id_and_data) {
+    // returns the number of bytes written, 0 if the device was busy, -1 for error
+#ifdef USE_HIDRAW_FD
+    ssize_t bytes_written = write(device, report_id_and_data, QMK_RAW_HID_REPORT_SIZE + 1);
+    if (bytes_written < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    }
+    return (int)bytes_written;
+#else
+    bool allocations_were_checked = allocation_check_suspend();
+    int bytes_written = hid_write(device, report_id_and_data, QMK_RAW_HID_REPORT_SIZE + 1);
+    allocation_check_resume(allocations_were_checked);
+    return bytes_written;
+#endif
+}
+
+// ============================================================================
+// REPORT RINGS (single producer, single consumer)
+// ============================================================================
+
+#ifdef USE_REPORT_RINGS
+void report_ring_init(raw_hid_report_ring_t* ring) {
+    atomic_store(&(ring->head), 0);
+    atomic_store(&(ring->tail), 0);
+    atomic_store(&(ring->n_dropped), 0);
+}
+
+bool report_ring_push(raw_hid_report_ring_t* ring, const raw_hid_report_t* report) {
+    // returns false if the ring is full
+    unsigned int tail = atomic_load_explicit(&(ring->tail), memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&(ring->head), memory_order_acquire);
+    if (tail - head == REPORT_RING_CAPACITY) {
+        atomic_fetch_add_explicit(&(ring->n_dropped), 1, memory_order_relaxed);
+        return false;
+    }
+    ring->reports[tail % REPORT_RING_CAPACITY] = *report;
+    atomic_store_explicit(&(ring->tail), tail + 1, memory_order_release);
+    return true;
+}
+
+bool report_ring_pop(raw_hid_report_ring_t* ring, raw_hid_report_t* report) {
+    // returns false if the ring is empty
+    unsigned int head = atomic_load_explicit(&(ring->head), memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&(ring->tail), memory_order_acquire);
+    if (head == tail) {
+        return false;
+    }
+    *report = ring->reports[head % REPORT_RING_CAPACITY];
+    atomic_store_explicit(&(ring->head), head + 1, memory_order_release);
+    return true;
+}
+
+bool report_ring_is_full(raw_hid_report_ring_t* ring) {
+    // only exact when called by the producer
+    return atomic_load(&(ring->tail)) - atomic_load(&(ring->head)) == REPORT_RING_CAPACITY;
+}
+
+bool report_ring_is_empty(raw_hid_report_ring_t* ring) {
+    // only exact when called by the consumer
+    return atomic_load(&(ring->tail)) == atomic_load(&(ring->head));
+}
+#endif
+
+// ============================================================================
+// MESSAGE INBOXES (multiple producers, single consumer)
+// ============================================================================
+
+#ifdef USE_MESSAGE_INBOXES
+void message_inbox_init(raw_hid_message_inbox_t* inbox) {
+    atomic_store(&(inbox->tail), 0);
+    atomic_store(&(inbox->head), 0);
+    for (unsigned int i = 0; i < MESSAGE_INBOX_CAPACITY; i++) {
+        atomic_store(&(inbox->cells[i].sequence), i);
+    }
+}
+
+bool message_inbox_push(raw_hid_message_inbox_t* inbox, const raw_hid_report_t* report) {
+    // safe to call from any thread, returns false if the inbox is full
+    raw_hid_message_inbox_cell_t* cell;
+    unsigned int position = atomic_load_explicit(&(inbox->tail), memory_order_relaxed);
+    while (true) {
+        cell = &(inbox->cells[position & (MESSAGE_INBOX_CAPACITY - 1)]);
+        unsigned int sequence = atomic_load_explicit(&(cell->sequence), memory_order_acquire);
+        int difference = (int)(sequence - position);
+        if (difference == 0) {
+            // the cell is free for this lap, claim it
+            if (atomic_compare_exchange_weak_explicit(&(inbox->tail), &position, position + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            // the consumer hasn't taken the previous lap's report yet
+            return false;
+        } else {
+            // another producer claimed it first
+            position = atomic_load_explicit(&(inbox->tail), memory_order_relaxed);
+        }
+    }
+    cell->report = *report;
+    atomic_store_explicit(&(cell->sequence), position + 1, memory_order_release);
+    return true;
+}
+
+bool message_inbox_peek(raw_hid_message_inbox_t* inbox, raw_hid_report_t* report) {
+    // returns false if the inbox is empty, or the next producer hasn't finished writing its report
+    unsigned int position = atomic_load_explicit(&(inbox->head), memory_order_relaxed);
+    raw_hid_message_inbox_cell_t* cell = &(inbox->cells[position & (MESSAGE_INBOX_CAPACITY - 1)]);
+    if (atomic_load_explicit(&(cell->sequence), memory_order_acquire) != position + 1) {
+        return false;
+    }
+    *report = cell->report;
+    return true;
+}
+
+void message_inbox_pop(raw_hid_message_inbox_t* inbox) {
+    // drops the report that message_inbox_peek returned, freeing its cell for the next lap
+    unsigned int position = atomic_load_explicit(&(inbox->head), memory_order_relaxed);
+    raw_hid_message_inbox_cell_t* cell = &(inbox->cells[position & (MESSAGE_INBOX_CAPACITY - 1)]);
+    atomic_store_explicit(&(cell->sequence), position + MESSAGE_INBOX_CAPACITY, memory_order_release);
+    atomic_store_explicit(&(inbox->head), position + 1, memory_order_relaxed);
+}
+#endif
+
+// ============================================================================
+// IO_URING (linux only, parent only)
+// ============================================================================
+
+#ifdef USE_IO_URING_LINUX
+void io_uring_init(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    uring.fd = (int)syscall(__NR_io_uring_setup, IO_URING_ENTRIES, &params);
+    if (uring.fd < 0 || !(params.features & IORING_FEAT_EXT_ARG)) {
+        printf("Error creating io_uring instance (Linux 5.11 or newer is required).\n");
+        exit(1);
+    }
+    uring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    uring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (uring.cq_ring_size > uring.sq_ring_size) {
+            uring.sq_ring_size = uring.cq_ring_size;
+        }
+        uring.cq_ring_size = uring.sq_ring_size;
+    }
+    uring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring.sq_ring = mmap(NULL, uring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        uring.cq_ring = uring.sq_ring;
+    } else {
+        uring.cq_ring = mmap(NULL, uring.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_CQ_RING);
+    }
+    uring.sqes = mmap(NULL, uring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+    if (uring.sq_ring == MAP_FAILED || uring.cq_ring == MAP_FAILED || uring.sqes == MAP_FAILED) {
+        printf("Error mapping io_uring queues.\n");
+        exit(1);
+    }
+    uring.sq_head = (unsigned*)((char*)uring.sq_ring + params.sq_off.head);
+    uring.sq_tail = (unsigned*)((char*)uring.sq_ring + params.sq_off.tail);
+    uring.sq_array = (unsigned*)((char*)uring.sq_ring + params.sq_off.array);
+    uring.sq_mask = *(unsigned*)((char*)uring.sq_ring + params.sq_off.ring_mask);
+    uring.sq_entries = params.sq_entries;
+    uring.sq_tail_local = *uring.sq_tail;
+    uring.cq_head = (unsigned*)((char*)uring.cq_ring + params.cq_off.head);
+    uring.cq_tail = (unsigned*)((char*)uring.cq_ring + params.cq_off.tail);
+    uring.cq_mask = *(unsigned*)((char*)uring.cq_ring + params.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe*)((char*)uring.cq_ring + params.cq_off.cqes);
+    for (unsigned i = 0; i < uring.sq_entries; i++) {
+        // sqe i always sits in slot i
+        uring.sq_array[i] = i;
+    }
+    uring.submit_generation = 0;
+    uring.last_write_sqe = NULL;
+    uring.last_write_node = NULL;
+}
+
+void io_uring_free(void) {
+    // closing the ring cancels everything that's still in flight
+    if (uring.fd == -1) {
+        return;
+    }
+    munmap(uring.sqes, uring.sqes_size);
+    if (uring.cq_ring != uring.sq_ring) {
+        munmap(uring.cq_ring, uring.cq_ring_size);
+    }
+    munmap(uring.sq_ring, uring.sq_ring_size);
+    close(uring.fd);
+    uring.fd = -1;
+}
+
+int io_uring_submit_and_wait(int timeout_ms) {
+    // submits all prepared sqes and waits up to timeout_ms for a completion, -1 waits forever
+    unsigned n_to_submit = uring.sq_tail_local - atomic_load_explicit((_Atomic unsigned*)uring.sq_head, memory_order_acquire);
+    if (n_to_submit == 0 && timeout_ms == 0) {
+        // completions show up in the queue without a syscall
+        return 0;
+    }
+    atomic_store_explicit((_Atomic unsigned*)uring.sq_tail, uring.sq_tail_local, memory_order_release);
+    struct __kernel_timespec timeout = {.tv_sec = timeout_ms / 1000, .tv_nsec = (long long)(timeout_ms % 1000) * 1000000};
+    struct io_uring_getevents_arg arg = {.ts = timeout_ms > 0 ? (uint64_t)(uintptr_t)&timeout : 0};
+    unsigned flags = IORING_ENTER_EXT_ARG;
+    unsigned min_complete = 0;
+    if (timeout_ms != 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+        min_complete = 1;
+    }
+    int result = (int)syscall(__NR_io_uring_enter, uring.fd, n_to_submit, min_complete, flags, &arg, sizeof(arg));
+    io_uring_enters_since_last_stats++;
+    if (n_to_submit > 0) {
+        uring.submit_generation++;
+        uring.last_write_sqe = NULL;
+        if (result > 0) {
+            io_uring_submissions_since_last_stats += result;
+        }
+    }
+    return result;
+}
+
+bool io_uring_make_space(void) {
+    // flushes the submission queue if it's full, returns false if that didn't help
+    if (uring.sq_tail_local - atomic_load_explicit((_Atomic unsigned*)uring.sq_head, memory_order_acquire) < uring.sq_entries) {
+        return true;
+    }
+    io_uring_submit_and_wait(0);
+    return uring.sq_tail_local - atomic_load_explicit((_Atomic unsigned*)uring.sq_head, memory_order_acquire) < uring.sq_entries;
+}
+
+struct io_uring_sqe* io_uring_get_sqe(void) {
+    // returns NULL if the submission queue is full
+    if (!io_uring_make_space()) {
+        return NULL;
+    }
+    struct io_uring_sqe* sqe = &(uring.sqes[uring.sq_tail_local & uring.sq_mask]);
+    memset(sqe, 0, sizeof(*sqe));
+    uring.sq_tail_local++;
+    uring.last_write_sqe = NULL;
+    return sqe;
+}
+
+void io_uring_start_wake_read(void) {
+    if (uring_wake_read_in_flight) {
+        return;
+    }
+    struct io_uring_sqe* sqe = io_uring_get_sqe();
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wake_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&uring_wake_count;
+    sqe->len = sizeof(uring_wake_count);
+    sqe->user_data = IO_URING_OP_READ;
+    uring_wake_read_in_flight = true;
+}
+
+void io_uring_node_start_read(raw_hid_node_t* node) {
+    // keeps a read outstanding on the device, unless its ring is full or it's going away
+    if (node->uring_read_in_flight || node->uring_read_failed || atomic_load(&(node->is_marked_for_unregistration)) || report_ring_is_full(&(node->reader_ring))) {
+        return;
+    }
+    struct io_uring_sqe* sqe = io_uring_get_sqe();
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = node->device;
+    sqe->addr = (uint64_t)(uintptr_t)node->uring_read_buffer;
+    sqe->len = QMK_RAW_HID_REPORT_SIZE;
+    sqe->user_data = (uint64_t)(uintptr_t)node | IO_URING_OP_READ;
+    node->uring_read_in_flight = true;
+}
+
+bool io_uring_node_can_write(raw_hid_node_t* node) {
+    // a batch of writes has to complete before the next one starts, so reports can't overtake each other
+    if (!io_uring_make_space()) {
+        return false;
+    }
+    if (node->uring_n_writes_in_flight == 0) {
+        return true;
+    }
+    // links only join neighbouring sqes, so once another sqe was prepared after the node's last write,
+    // a further write couldn't be linked to it and the blocking fd would let io-wq run them in any order
+    bool chain_is_open = uring.last_write_node == node && uring.last_write_sqe != NULL;
+    return node->uring_write_generation == uring.submit_generation && chain_is_open && node->uring_n_writes_in_flight < IO_URING_WRITES_PER_DEVICE;
+}
+
+void io_uring_node_write(raw_hid_node_t* node, const unsigned char* data) {
+    // only call this after io_uring_node_can_write()
+    struct io_uring_sqe* previous_sqe = uring.last_write_node == node ? uring.last_write_sqe : NULL;
+    struct io_uring_sqe* sqe = io_uring_get_sqe();
+    if (previous_sqe != NULL) {
+        // run back to back writes to the same device in order
+        previous_sqe->flags |= IOSQE_IO_LINK;
+    }
+    unsigned char* report_id_and_data = node->uring_write_buffers[node->uring_n_writes_in_flight];
+    report_id_and_data[0] = QMK_RAW_HID_REPORT_ID;
+    memcpy(report_id_and_data + 1, data, QMK_RAW_HID_REPORT_SIZE);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = node->device;
+    sqe->addr = (uint64_t)(uintptr_t)report_id_and_data;
+    sqe->len = QMK_RAW_HID_REPORT_SIZE + 1;
+    sqe->user_data = (uint64_t)(uintptr_t)node | IO_URING_OP_WRITE;
+    node->uring_n_writes_in_flight++;
+    node->uring_write_generation = uring.submit_generation;
+    uring.last_write_sqe = sqe;
+    uring.last_write_node = node;
+}
+
+bool io_uring_node_retire(raw_hid_node_t* node) {
+    // returns true once the kernel is done with the node's buffers
+    if (node->uring_read_in_flight && !node->uring_read_cancelled) {
+        struct io_uring_sqe* sqe = io_uring_get_sqe();
+        if (sqe != NULL) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = (uint64_t)(uintptr_t)node | IO_URING_OP_READ;
+            sqe->user_data = (uint64_t)(uintptr_t)node | IO_URING_OP_CANCEL;
+            node->uring_read_cancelled = true;
+        }
+    }
+    return !node->uring_read_in_flight && node->uring_n_writes_in_flight == 0;
+}
+
+void io_uring_handle_completion(uint64_t user_data, int result) {
+    raw_hid_node_t* node = (raw_hid_node_t*)(uintptr_t)(user_data & ~(uint64_t)IO_URING_OP_MASK);
+    switch (user_data & IO_URING_OP_MASK) {
+        case IO_URING_OP_READ:
+            if (node == NULL) {
+                uring_wake_read_in_flight = false;
+                break;
+            }
+            node->uring_read_in_flight = false;
+            if (result > 0) {
+                raw_hid_report_t report;
+                report.time_ns = monotonic_time_ns();
+                report.length = result;
+                memcpy(report.data, node->uring_read_buffer, QMK_RAW_HID_REPORT_SIZE);
+                report_ring_push(&(node->reader_ring), &report);
+                io_uring_node_start_read(node);
+            } else if (result != -ECANCELED && result != -EINTR && result != -EAGAIN) {
+                // the device is probably gone, the next iteration unregisters it
+                node->uring_read_failed = true;
+                atomic_store(&(node->has_io_error), true);
+            }
+            break;
+        case IO_URING_OP_WRITE:
+            node->uring_n_writes_in_flight--;
+            if (result < 0 && result != -ECANCELED && result != -EINTR && result != -EAGAIN) {
+                atomic_store(&(node->has_io_error), true);
+            }
+            break;
+        default:
+            // cancellations, the node may already be gone
+            break;
+    }
+}
+
+void io_uring_reap(void) {
+    unsigned head = *uring.cq_head;
+    unsigned tail = atomic_load_explicit((_Atomic unsigned*)uring.cq_tail, memory_order_acquire);
+    while (head != tail) {
+        struct io_uring_cqe* cqe = &(uring.cqes[head & uring.cq_mask]);
+        io_uring_handle_completion(cqe->user_data, cqe->res);
+        io_uring_completions_since_last_stats++;
+        head++;
+    }
+    atomic_store_explicit((_Atomic unsigned*)uring.cq_head, head, memory_order_release);
+}
+#endif
+
+// ============================================================================
+// EVENT LOOP
+// ============================================================================
+
+#ifdef USE_MAIN_LOOP_WAKE
+int main_loop_timeout_ms(void) {
+    if (low_latency_mode) {
+        return 0;
+    }
+    // don't block while there's still something to send
+    if (n_queued_messages > 0 || registrations_changed || reads_are_pending) {
+#if defined(USE_WRITER_THREADS_POSIX) || defined(USE_HIDRAW_FD)
+        // back off a little instead of spinning on a device that can't take more writes
+        return writers_are_backlogged ? 1 : 0;
+#else
+        return 0;
+#endif
+    }
+    int timeout_ms = -1;
+#ifdef USE_IDLE_TIERS
+    if (idle_tier == IDLE_TIER_HOT) {
+        // readiness wakes every tier right away, the hot tier only has to wake up in time to move to the warm tier
+        uint64_t idle_time_ms = current_time_ms - last_message_time_ms;
+        timeout_ms = idle_time_ms < IDLE_WARM_AFTER_MILLISECONDS ? (int)(IDLE_WARM_AFTER_MILLISECONDS - idle_time_ms) : 0;
+    }
+#endif
+    if (verbose_stats) {
+        uint64_t delta_time_ms = current_time_ms - last_stats_time_ms;
+        int stats_timeout_ms = delta_time_ms < STATS_INTERVAL_MS ? (int)(STATS_INTERVAL_MS - delta_time_ms) : 0;
+        if (timeout_ms < 0 || stats_timeout_ms < timeout_ms) {
+            timeout_ms = stats_timeout_ms;
+        }
+    }
+    return timeout_ms;
+}
+#endif
+
+#ifdef USE_EPOLL_LINUX
+void event_loop_init(void) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd == -1 || wake_fd == -1) {
+        printf("Error creating epoll instance.");
+        exit(1);
+    }
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event) != 0) {
+        printf("Error adding eventfd to epoll instance.");
+        exit(1);
+    }
+}
+
+void event_loop_free(void) {
+    if (epoll_fd != -1) {
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+    if (wake_fd != -1) {
+        close(wake_fd);
+        wake_fd = -1;
+    }
+}
+
+bool event_loop_add_node(raw_hid_node_t* node) {
+    // returns false if the device can't be waited on
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = node};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, node->device, &event) != 0) {
+        printf("Error adding device to epoll instance: %s.\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void event_loop_remove_node(raw_hid_node_t* node) {
+    // a node can be removed both when it hangs up and when it's unregistered
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, node->device, NULL) != 0 && errno != ENOENT) {
+        printf("Error removing device from epoll instance: %s.\n", strerror(errno));
+    }
+}
+
+void event_loop_wait(void) {
+    struct epoll_event events[MAX_REGISTERED_DEVICES + 1];
+    int n_events = epoll_wait(epoll_fd, events, MAX_REGISTERED_DEVICES + 1, main_loop_timeout_ms());
+    for (int i = 0; i < n_events; i++) {
+        raw_hid_node_t* node = (raw_hid_node_t*)events[i].data.ptr;
+        if (node == NULL) {
+            uint64_t count;
+            ssize_t unused = read(wake_fd, &count, sizeof(count));
+            (void)unused;
+        } else if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+            // most likely unplugged, and a level triggered hang up would end every wait right away from now on
+            event_loop_remove_node(node);
+            atomic_store(&(node->has_io_error), true);
+        } else {
+            node->is_readable = true;
+        }
+    }
+}
+#endif
+
+#ifdef USE_IO_URING_LINUX
+void event_loop_init(void) {
+    wake_fd = eventfd(0, EFD_CLOEXEC);  // blocking, so that its read waits in the kernel
+    if (wake_fd == -1) {
+        printf("Error creating eventfd.");
+        exit(1);
+    }
+    io_uring_init();
+}
+
+void event_loop_free(void) {
+    io_uring_free();
+    if (wake_fd != -1) {
+        close(wake_fd);
+        wake_fd = -1;
+    }
+}
+
+void event_loop_wait(void) {
+    // one syscall submits the writes and reads queued up during the iteration and waits for completions
+    io_uring_start_wake_read();
+    io_uring_submit_and_wait(main_loop_timeout_ms());
+    io_uring_reap();
+}
+#endif
+
+#ifdef USE_READER_THREADS_POSIX
+void event_loop_wait(void) {
+    int timeout_ms = main_loop_timeout_ms();
+    pthread_mutex_lock(&main_loop_wake_mutex);
+    if (timeout_ms < 0) {
+        while (!main_loop_wake_pending) {
+            pthread_cond_wait(&main_loop_wake_cond, &main_loop_wake_mutex);
+        }
+    } else if (timeout_ms > 0) {
+        // condition variables use the realtime clock by default, and macos offers nothing else
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (!main_loop_wake_pending) {
+            if (pthread_cond_timedwait(&main_loop_wake_cond, &main_loop_wake_mutex, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+    }
+    main_loop_wake_pending = false;
+    pthread_mutex_unlock(&main_loop_wake_mutex);
+}
+#endif
+
+#ifdef USE_MAIN_LOOP_WAKE
+void main_loop_wake(void) {
+    // called whenever the parent has something new to look at
+#if defined(USE_EPOLL_LINUX) || defined(USE_IO_URING_LINUX)
+    uint64_t one = 1;
+    ssize_t unused = write(wake_fd, &one, sizeof(one));
+    (void)unused;
+#else
+    pthread_mutex_lock(&main_loop_wake_mutex);
+    main_loop_wake_pending = true;
+    pthread_cond_signal(&main_loop_wake_cond);
+    pthread_mutex_unlock(&main_loop_wake_mutex);
+#endif
+}
+#endif
+
+// ============================================================================
+// READER THREADS (posix only)
+// ============================================================================
+
+#ifdef USE_READER_THREADS_POSIX
+void* reader_thread(void* arg) {
+    raw_hid_node_t* node = (raw_hid_node_t*)arg;
+    raw_hid_report_t report;
+    while (!atomic_load(&(node->reader_termination_flag))) {
+        report.length = raw_hid_read_timeout(node->device, report.data, READER_TIMEOUT_MILLISECONDS);
+        if (report.length < 0) {
+            // the device is probably gone, the parent unregisters it right away
+            atomic_store(&(node->has_io_error), true);
+            main_loop_wake();
+            break;
+        }
+        if (report.length > 0) {
+            report.time_ns = monotonic_time_ns();
+            if (report_ring_push(&(node->reader_ring), &report)) {
+                main_loop_wake();
+            }
+        }
+    }
+    atomic_store(&(node->reader_is_done), true);
+    return NULL;
+}
+
+int reader_thread_start(raw_hid_node_t* node) {
+    report_ring_init(&(node->reader_ring));
+    atomic_store(&(node->reader_termination_flag), false);
+    atomic_store(&(node->reader_is_done), false);
+    return pthread_create(&(node->reader_thread), NULL, reader_thread, node) == 0 ? 0 : -1;
+}
+
+void reader_thread_stop(raw_hid_node_t* node) {
+    atomic_store(&(node->reader_termination_flag), true);
+    pthread_join(node->reader_thread, NULL);
+}
+#endif
+
+// ============================================================================
+// WRITER THREADS (posix only)
+// ============================================================================
+
+#ifdef USE_WRITER_THREADS_POSIX
+void writer_write(raw_hid_node_t* node, const raw_hid_report_t* report) {
+    raw_hid_writer_stats_t* stats = &(node->writer_stats);
+    uint64_t start_ns = monotonic_time_ns();
+    if (start_ns - report->time_ns > (uint64_t)WRITER_TIMEOUT_MILLISECONDS * 1000000) {
+        // stale by now, and writing it would only delay the reports behind it
+        atomic_fetch_add(&(stats->n_expired), 1);
+        return;
+    }
+    unsigned char report_id_and_data[QMK_RAW_HID_REPORT_SIZE + 1];
+    report_id_and_data[0] = QMK_RAW_HID_REPORT_ID;
+    memcpy(report_id_and_data + 1, report->data, QMK_RAW_HID_REPORT_SIZE);
+    if (raw_hid_write(node->device, report_id_and_data) < 0 && !atomic_exchange(&(node->has_io_error), true)) {
+        // the device is probably gone, the parent unregisters it right away
+#    ifdef USE_MAIN_LOOP_WAKE
+        main_loop_wake();
+#    endif
+    }
+    uint64_t write_ns = monotonic_time_ns() - start_ns;
+    atomic_fetch_add(&(stats->n_writes), 1);
+    atomic_fetch_add(&(stats->write_ns_total), write_ns);
+    if (write_ns > atomic_load(&(stats->write_ns_max))) {
+        atomic_store(&(stats->write_ns_max), write_ns);
+    }
+    if (write_ns > (uint64_t)WRITER_TIMEOUT_MILLISECONDS * 1000000) {
+        atomic_fetch_add(&(stats->n_slow), 1);
+    }
+}
+
+void* writer_thread(void* arg) {
+    raw_hid_node_t* node = (raw_hid_node_t*)arg;
+    raw_hid_report_t report;
+    while (true) {
+        pthread_mutex_lock(&(node->writer_mutex));
+        while (!report_ring_pop(&(node->writer_ring), &report)) {
+            if (atomic_load(&(node->writer_termination_flag))) {
+                pthread_mutex_unlock(&(node->writer_mutex));
+                atomic_store(&(node->writer_is_done), true);
+                return NULL;
+            }
+            pthread_cond_wait(&(node->writer_cond), &(node->writer_mutex));
+        }
+        pthread_mutex_unlock(&(node->writer_mutex));
+        writer_write(node, &report);
+    }
+}
+
+bool writer_thread_push(raw_hid_node_t* node, const unsigned char* data) {
+    // returns false if the writer is too far behind to take another report
+    raw_hid_report_t report;
+    report.time_ns = monotonic_time_ns();
+    report.length = QMK_RAW_HID_REPORT_SIZE;
+    memcpy(report.data, data, QMK_RAW_HID_REPORT_SIZE);
+    if (!report_ring_push(&(node->writer_ring), &report)) {
+        return false;
+    }
+    pthread_mutex_lock(&(node->writer_mutex));
+    pthread_cond_signal(&(node->writer_cond));
+    pthread_mutex_unlock(&(node->writer_mutex));
+    return true;
+}
+
+int writer_thread_start(raw_hid_node_t* node) {
+    report_ring_init(&(node->writer_ring));
+    memset(&(node->writer_stats), 0, sizeof(node->writer_stats));
+    atomic_store(&(node->writer_termination_flag), false);
+    atomic_store(&(node->writer_is_done), false);
+    pthread_mutex_init(&(node->writer_mutex), NULL);
+    pthread_cond_init(&(node->writer_cond), NULL);
+    if (pthread_create(&(node->writer_thread), NULL, writer_thread, node) != 0) {
+        pthread_cond_destroy(&(node->writer_cond));
+        pthread_mutex_destroy(&(node->writer_mutex));
+        return -1;
+    }
+    return 0;
+}
+
+void writer_thread_request_stop(raw_hid_node_t* node) {
+    // the writer finishes what's in its ring first
+    pthread_mutex_lock(&(node->writer_mutex));
+    atomic_store(&(node->writer_termination_flag), true);
+    pthread_cond_signal(&(node->writer_cond));
+    pthread_mutex_unlock(&(node->writer_mutex));
+}
+
+void writer_thread_stop(raw_hid_node_t* node) {
+    writer_thread_request_stop(node);
+    pthread_join(node->writer_thread, NULL);
+    pthread_cond_destroy(&(node->writer_cond));
+    pthread_mutex_destroy(&(node->writer_mutex));
+}
+#endif
+
+// ============================================================================
+// raw_hid_node_t MEMORY MANAGEMENT (child only)
+// ============================================================================
+
+unsigned int node_index_bucket(const char* path) {
+    // fnv-1a
+    uint32_t hash = 2166136261u;
+    for (const unsigned char* c = (const unsigned char*)path; *c != '\0'; c++) {
+        hash = (hash ^ *c) * 16777619u;
+    }
+    return hash % NODE_INDEX_BUCKETS;
+}
+
+void node_index_add(raw_hid_node_t* node) {
+    unsigned int bucket = node_index_bucket(node->path);
+    node->next_in_index = node_index[bucket];
+    node_index[bucket] = node;
+}
+
+void node_index_remove(raw_hid_node_t* node) {
+    raw_hid_node_t** link = &node_index[node_index_bucket(node->path)];
+    while (*link != NULL) {
+        if (*link == node) {
+            *link = node->next_in_index;
+            return;
+        }
+        link = &((*link)->next_in_index);
+    }
+}
+
+raw_hid_node_t* node_index_find(const char* path) {
+    // returns the open device at the path that isn't on its way out, NULL if there's none
+    raw_hid_node_t* current_node = node_index[node_index_bucket(path)];
+    while (current_node != NULL) {
+        if (strcmp(current_node->path, path) == 0 && !atomic_load(&(current_node->is_marked_for_unregistration))) {
+            return current_node;
+        }
+        current_node = current_node->next_in_index;
+    }
+    return NULL;
+}
+
+const raw_hid_device_config_t* find_device_config(unsigned short vendor_id, unsigned short product_id) {
+    // returns NULL if the device has no settings of its own
+    for (size_t i = 0; i < sizeof(device_configs) / sizeof(device_configs[0]); i++) {
+        const raw_hid_device_config_t* config = &device_configs[i];
+        if (config->vendor_id == vendor_id && config->product_id == product_id) {
+            return config;
+        }
+    }
+    return NULL;
+}
+
+raw_hid_node_t* raw_hid_node_new(raw_hid_handle_t device, const char* path, unsigned short vendor_id, unsigned short product_id) {
+    if (strlen(path) >= MAX_DEVICE_PATH_LENGTH) {
+        if (verbose_basic) {
+            printf("Device path is too long: %s\n", path);
+        }
+        return NULL;
+    }
+    raw_hid_node_t* new_node = (raw_hid_node_t*)pool_get(&node_pool);
+    if (new_node == NULL) {
+        if (verbose_basic) {
+            printf("Too many open devices.\n");
+        }
+        return NULL;
+    }
+    new_node->device = device;
+    strcpy(new_node->path, path);
+    new_node->vendor_id = vendor_id;
+    new_node->product_id = product_id;
+    new_node->device_id = DEVICE_ID_UNASSIGNED;
+    new_node->is_in_enumeration = true;
+#ifdef USE_ROUTER_SHARDS
+    // the shard with the fewest devices takes the new one
+    new_node->shard = 0;
+    for (int shard = 1; shard < ROUTER_SHARDS; shard++) {
+        if (n_shard_nodes[shard] < n_shard_nodes[new_node->shard]) {
+            new_node->shard = shard;
+        }
+    }
+    n_shard_nodes[new_node->shard]++;
+#else
+    new_node->shard = 0;
+#endif
+    const raw_hid_device_config_t* config = find_device_config(vendor_id, product_id);
+    new_node->read_weight = (config != NULL && config->read_weight > 0) ? config->read_weight : 1.0;
+    new_node->read_deficit = 0;
+    new_node->n_read_budgets_exhausted = 0;
+    new_node->queue_capacity = (config != NULL && config->queue_capacity > 0 && config->queue_capacity < MESSAGE_QUEUE_CAPACITY) ? config->queue_capacity : MESSAGE_QUEUE_CAPACITY;
+    new_node->overflow_policy = (config != NULL && config->overflow_policy != OVERFLOW_POLICY_DEFAULT) ? config->overflow_policy : MESSAGE_QUEUE_OVERFLOW_POLICY;
+    new_node->held_message = NULL;
+#ifdef USE_EPOLL_LINUX
+    new_node->is_readable = true;  // check once in case reports arrived before the node was added to epoll
+#endif
+#ifdef USE_IO_URING_LINUX
+    // the parent starts the first read
+    report_ring_init(&(new_node->reader_ring));
+    new_node->uring_read_in_flight = false;
+    new_node->uring_read_failed = false;
+    new_node->uring_read_cancelled = false;
+    new_node->uring_n_writes_in_flight = 0;
+    new_node->uring_write_generation = 0;
+#endif
+    atomic_store(&(new_node->is_marked_for_unregistration), false);
+    atomic_store(&(new_node->is_marked_for_deletion), false);
+    atomic_store(&(new_node->has_io_error), false);
+    atomic_store(&(new_node->next), NULL);
+#ifdef USE_WRITER_THREADS_POSIX
+    if (writer_thread_start(new_node) != 0) {
+#    ifdef USE_ROUTER_SHARDS
+        n_shard_nodes[new_node->shard]--;
+#    endif
+        pool_put(&node_pool, new_node);
+        return NULL;
+    }
+#endif
+#ifdef USE_READER_THREADS_POSIX
+    if (reader_thread_start(new_node) != 0) {
+#    ifdef USE_WRITER_THREADS_POSIX
+        writer_thread_stop(new_node);
+#    endif
+        pool_put(&node_pool, new_node);
+        return NULL;
+    }
+#endif
+#ifdef USE_EPOLL_LINUX
+    // before the node is linked, an event that comes in early only sets is_readable
+    if (!event_loop_add_node(new_node)) {
+#    ifdef USE_WRITER_THREADS_POSIX
+        writer_thread_stop(new_node);
+#    endif
+        pool_put(&node_pool, new_node);
+        return NULL;
+    }
+#endif
+    // new devices go at the end so the parent keeps going over the others in the same order
+    if (raw_hid_nodes_tail == NULL) {
+        atomic_store(&raw_hid_nodes, new_node);
+    } else {
+        atomic_store(&(raw_hid_nodes_tail->next), new_node);
+    }
+    raw_hid_nodes_tail = new_node;
+    node_index_add(new_node);
+#ifdef USE_IO_URING_LINUX
+    main_loop_wake();  // so that the parent starts reading
+#endif
+    return new_node;
+}
+
+void raw_hid_node_free(raw_hid_node_t* node) {
+    if (node == NULL) {
+        return;
+    }
+#ifdef USE_READER_THREADS_POSIX
+    reader_thread_stop(node);
+#endif
+#ifdef USE_WRITER_THREADS_POSIX
+    writer_thread_stop(node);
+#endif
+#ifdef USE_ROUTER_SHARDS
+    n_shard_nodes[node->shard]--;
+#endif
+    raw_hid_close(node->device);
+    pool_put(&node_pool, node);
+}
+
+void raw_hid_node_retire(raw_hid_node_t* node) {
+    // the node is already unlinked, so a shard can only still be on it until its current iteration ends
+    node->retire_epoch = atomic_fetch_add(&node_epoch, 1) + 1;
+    node->next_retired = retired_nodes;
+    retired_nodes = node;
+    // its threads wind down in the meantime, so that freeing it later doesn't have to wait for them
+#ifdef USE_READER_THREADS_POSIX
+    atomic_store(&(node->reader_termination_flag), true);
+#endif
+#ifdef USE_WRITER_THREADS_POSIX
+    writer_thread_request_stop(node);
+#endif
+}
+
+bool raw_hid_node_threads_are_done(raw_hid_node_t* node) {
+    // returns true once joining the node's threads won't block
+#ifdef USE_READER_THREADS_POSIX
+    if (!atomic_load(&(node->reader_is_done))) {
+        return false;
+    }
+#endif
+#ifdef USE_WRITER_THREADS_POSIX
+    if (!atomic_load(&(node->writer_is_done))) {
+        return false;
+    }
+#endif
+    (void)node;
+    return true;
+}
+
+void raw_hid_node_reclaim(void) {
+    // frees the retired nodes that every shard and the node's own threads have moved on from, never waits for them
+    uint64_t oldest_epoch = UINT64_MAX;
+    for (int shard = 0; shard < ROUTER_SHARDS; shard++) {
+        uint64_t epoch = atomic_load(&(shard_epochs[shard].epoch));
+        if (epoch < oldest_epoch) {
+            oldest_epoch = epoch;
+        }
+    }
+    raw_hid_node_t** link = &retired_nodes;
+    while (*link != NULL) {
+        raw_hid_node_t* node = *link;
+        if (node->retire_epoch <= oldest_epoch && raw_hid_node_threads_are_done(node)) {
+            *link = node->next_retired;
+            raw_hid_node_free(node);
+        } else {
+            link = &(node->next_retired);
+        }
+    }
+}
+
+void raw_hid_node_free_all(void) {
+    raw_hid_node_t* current_node = atomic_load(&raw_hid_nodes);
+    raw_hid_node_t* next_node = NULL;
+    while (current_node != NULL) {
+        next_node = atomic_load(&current_node->next);
+        raw_hid_node_free(current_node);
+        current_node = next_node;
+    }
+    while (retired_nodes != NULL) {
+        next_node = retired_nodes->next_retired;
+        raw_hid_node_free(retired_nodes);
+        retired_nodes = next_node;
+    }
+    atomic_store(&raw_hid_nodes, NULL);
+    raw_hid_nodes_tail = NULL;
+    memset(node_index, 0, sizeof(node_index));
+}
+
+// ============================================================================
+// HID ENUMERATION (child only)
+// ============================================================================
+
+int handle_raw_hid_device_found(const char* path, unsigned short vendor_id, unsigned short product_id) {
+    // returns 1 if a new device was opened, 0 if an existing open device was found, -1 for error
+    raw_hid_node_t* existing_node = node_index_find(path);
+    if (existing_node != NULL) {
+        existing_node->is_in_enumeration = true;
+        return 0;
+    }
+    raw_hid_handle_t device = raw_hid_open(path);
+    if (device == RAW_HID_HANDLE_INVALID) {
         return -1;
     }
-    hid_set_nonblocking(device, 1);  // set hid_read() to be nonblocking
-    raw_hid_node_t* new_node = raw_hid_node_new(device, path, previous_node);
+    raw_hid_node_t* new_node = raw_hid_node_new(device, path, vendor_id, product_id);
     if (new_node == NULL) {
-        hid_close(device);
+        raw_hid_close(device);
         return -1;
     }
     return 1;
 }
 
 int handle_raw_hid_device_missing(raw_hid_node_t* previous_node, raw_hid_node_t* current_node) {
-    // returns 1 if the node was freed, 0 if the node was marked for unregistration, -1 for error
+    // returns 1 if the node was unlinked to be freed later, 0 if the node was marked for unregistration, -1 for error
     if (atomic_load(&(current_node->is_marked_for_deletion))) {
         if (previous_node != NULL) {
             atomic_store(&(previous_node->next), atomic_load(&(current_node->next)));
         } else {
             atomic_store(&raw_hid_nodes, atomic_load(&(current_node->next)));
         }
-        atomic_store(&main_loop_new_iteration_flag, false);
-        // wait until we're certain the main process isn't on this node
-        while (!atomic_load(&main_loop_new_iteration_flag)) {
-#ifdef _WIN32
-            Sleep(SLEEP_MILLISECONDS_WINDOWS);
-#else
-            sleep_milliseconds(SLEEP_MILLISECONDS_POSIX);
-#endif
+        if (raw_hid_nodes_tail == current_node) {
+            raw_hid_nodes_tail = previous_node;
         }
-        raw_hid_node_free(current_node);
+        node_index_remove(current_node);
+        raw_hid_node_retire(current_node);
+#ifdef USE_MAIN_LOOP_WAKE
+        // so that a shard blocked in its wait gets between iterations
+        main_loop_wake();
+#endif
         return 1;
     } else {
         atomic_store(&(current_node->is_marked_for_unregistration), true);
+#ifdef USE_MAIN_LOOP_WAKE
+        main_loop_wake();
+#endif
+        return 0;
+    }
+}
+
+#ifdef USE_HOTPLUG_EVENTS
+void handle_raw_hid_device_removed(const char* path) {
+    // marks the device for unregistration right away, the parent unregisters it on its next iteration
+    raw_hid_node_t* node = node_index_find(path);
+    // a node that is already marked for deletion is unlinked by the next sweep, which knows its previous node
+    if (node != NULL && !atomic_load(&(node->is_marked_for_deletion))) {
+        atomic_store(&(node->is_marked_for_unregistration), true);
+#ifdef USE_MAIN_LOOP_WAKE
+        main_loop_wake();
+#endif
+    }
+}
+#endif
+
+#ifdef USE_HOTPLUG_EVENTS
+bool report_descriptor_has_usage(const unsigned char* descriptor, size_t length, unsigned int usage_page, unsigned int usage) {
+    // returns true if a top level collection has the usage, like hidapi's usage_page and usage
+    unsigned int current_usage_page = 0;
+    unsigned int first_usage = 0;  // the collection's usage is the first one since the last main item
+    bool has_usage = false;
+    int depth = 0;
+    size_t i = 0;
+    while (i < length) {
+        unsigned char prefix = descriptor[i];
+        if (prefix == 0xFE) {
+            // long item, its data size is in the next byte
+            if (i + 1 >= length) {
+                break;
+            }
+            i += 3 + descriptor[i + 1];
+            continue;
+        }
+        size_t size = prefix & 0x3;
+        if (size == 3) {
+            size = 4;
+        }
+        if (i + 1 + size > length) {
+            break;
+        }
+        unsigned int value = 0;
+        for (size_t j = 0; j < size; j++) {
+            value |= (unsigned int)descriptor[i + 1 + j] << (8 * j);
+        }
+        switch (prefix & 0xFC) {
+            case 0x04:  // usage page
+                current_usage_page = value;
+                break;
+            case 0x08:  // usage, with its own usage page in the high bytes if it's 4 bytes long
+                if (!has_usage) {
+                    first_usage = size == 4 ? value : (current_usage_page << 16) | value;
+                    has_usage = true;
+                }
+                break;
+            case 0xA0:  // collection
+                if (depth == 0 && has_usage && first_usage == ((usage_page << 16) | usage)) {
+                    return true;
+                }
+                depth++;
+                has_usage = false;
+                break;
+            case 0xC0:  // end collection
+                if (depth > 0) {
+                    depth--;
+                }
+                has_usage = false;
+                break;
+            case 0x80:  // input
+            case 0x90:  // output
+            case 0xB0:  // feature
+                has_usage = false;
+                break;
+        }
+        i += 1 + size;
+    }
+    return false;
+}
+
+ssize_t sysfs_read(const char* path, void* buffer, size_t size) {
+    // returns the number of bytes read, -1 for error
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t length = read(fd, buffer, size);
+    close(fd);
+    return length;
+}
+
+bool sysfs_read_device(const char* name, raw_hid_sysfs_device_t* sysfs_device) {
+    // fills in whether a hidraw node is a raw hid device and its ids, returns false if sysfs couldn't be read
+    char path[MAX_DEVICE_PATH_LENGTH];
+    static unsigned char buffer[SYSFS_REPORT_DESCRIPTOR_SIZE];
+    snprintf(path, sizeof(path), "/sys/class/hidraw/%s/device/report_descriptor", name);
+    ssize_t length = sysfs_read(path, buffer, sizeof(buffer));
+    if (length < 0) {
+        return false;
+    }
+    sysfs_device->is_raw_hid = report_descriptor_has_usage(buffer, (size_t)length, QMK_RAW_HID_USAGE_PAGE, QMK_RAW_HID_USAGE);
+    if (!sysfs_device->is_raw_hid) {
+        return true;
+    }
+    // HID_ID=0003:0000FEED:00000000
+    snprintf(path, sizeof(path), "/sys/class/hidraw/%s/device/uevent", name);
+    length = sysfs_read(path, buffer, sizeof(buffer) - 1);
+    if (length < 0) {
+        return false;
+    }
+    buffer[length] = '\0';
+    const char* hid_id = strstr((const char*)buffer, "HID_ID=");
+    unsigned int bus, vendor_id, product_id;
+    if (hid_id == NULL || sscanf(hid_id, "HID_ID=%x:%x:%x", &bus, &vendor_id, &product_id) != 3) {
+        return false;
+    }
+    sysfs_device->vendor_id = (unsigned short)vendor_id;
+    sysfs_device->product_id = (unsigned short)product_id;
+    return true;
+}
+
+int handle_hidraw_node(const char* name) {
+    // opens /dev/<name> if it's a new raw hid device, returns like handle_raw_hid_device_found or 0 if it isn't one
+    unsigned int minor;
+    if (sscanf(name, "hidraw%u", &minor) != 1) {
         return 0;
     }
+    // the device link stays the same for as long as the device is plugged in, so its descriptor only gets read once
+    char path[MAX_DEVICE_PATH_LENGTH];
+    char link[MAX_DEVICE_PATH_LENGTH];
+    snprintf(path, sizeof(path), "/sys/class/hidraw/%s/device", name);
+    ssize_t link_length = readlink(path, link, sizeof(link) - 1);
+    if (link_length < 0) {
+        return -1;
+    }
+    link[link_length] = '\0';
+    const char* hid_name = strrchr(link, '/');
+    hid_name = hid_name != NULL ? hid_name + 1 : link;
+    raw_hid_sysfs_device_t uncached_device;
+    raw_hid_sysfs_device_t* sysfs_device = minor < SYSFS_HIDRAW_CACHE_SIZE ? &sysfs_devices[minor] : &uncached_device;
+    if (sysfs_device == &uncached_device || strncmp(sysfs_device->hid_name, hid_name, sizeof(sysfs_device->hid_name)) != 0) {
+        if (!sysfs_read_device(name, sysfs_device)) {
+            sysfs_device->hid_name[0] = '\0';
+            return -1;
+        }
+        snprintf(sysfs_device->hid_name, sizeof(sysfs_device->hid_name), "%.*s", (int)sizeof(sysfs_device->hid_name) - 1, hid_name);
+    }
+    if (!sysfs_device->is_raw_hid) {
+        return 0;
+    }
+    snprintf(path, sizeof(path), "/dev/%s", name);
+    int result = handle_raw_hid_device_found(path, sysfs_device->vendor_id, sysfs_device->product_id);
+    if (verbose_basic && result == 1) {
+        printf("Opened a new raw HID device:\n");
+        printf("  Path:         %s\n", path);
+        printf("  Vendor ID:    0x%04hx\n", sysfs_device->vendor_id);
+        printf("  Product ID:   0x%04hx\n", sysfs_device->product_id);
+    }
+    return result;
 }
+#endif
 
 void enumerate_raw_hid_devices(void) {
 
@@ -368,12 +2610,24 @@ void enumerate_raw_hid_devices(void) {
     }
     
     // open any newly found devices
+    int result = 0;
+#ifdef USE_SYSFS_DISCOVERY_LINUX
+    DIR* dev_directory = opendir("/dev");
+    if (dev_directory != NULL) {
+        struct dirent* entry;
+        while ((entry = readdir(dev_directory)) != NULL) {
+            if (strncmp(entry->d_name, "hidraw", 6) == 0) {
+                handle_hidraw_node(entry->d_name);
+            }
+        }
+        closedir(dev_directory);
+    }
+#else
     struct hid_device_info* hid_enumeration_start = hid_enumerate(0x0, 0x0);
     struct hid_device_info* current_device_info = hid_enumeration_start;
-    int result = 0;
     while (current_device_info != NULL) {
         if (current_device_info->usage_page == QMK_RAW_HID_USAGE_PAGE && current_device_info->usage == QMK_RAW_HID_USAGE) {
-            result = handle_raw_hid_device_found(current_device_info->path);
+            result = handle_raw_hid_device_found(current_device_info->path, current_device_info->vendor_id, current_device_info->product_id);
             if (verbose_basic && result == 1) {
                 printf("Opened a new raw HID device:\n");
                 print_device_info(current_device_info);
@@ -382,106 +2636,790 @@ void enumerate_raw_hid_devices(void) {
         current_device_info = current_device_info->next;
     }
     hid_free_enumeration(hid_enumeration_start);
+#endif
 
     // close devices that weren't found in the enumeration
     current_node = atomic_load(&raw_hid_nodes);
     raw_hid_node_t* previous_node = NULL;
+    raw_hid_node_t* next_node = NULL;
     while (current_node != NULL) {
+        next_node = atomic_load(&(current_node->next));
+        result = 0;
         if (!current_node->is_in_enumeration) {
             result = handle_raw_hid_device_missing(previous_node, current_node);
             if (verbose_basic && result == 1) {
                 printf("Closed a missing raw HID device.\n");
             }
         }
-        previous_node = current_node;
-        current_node = atomic_load(&(current_node->next));
+        if (result != 1) {
+            // a removed node is no longer in the list, so the previous node stays the same
+            previous_node = current_node;
+        }
+        current_node = next_node;
+    }
+    raw_hid_node_reclaim();
+}
+
+void reap_raw_hid_devices(void) {
+    // frees the devices that were closed outside of an enumeration once the parent is done with them
+    raw_hid_node_t* current_node = atomic_load(&raw_hid_nodes);
+    raw_hid_node_t* previous_node = NULL;
+    raw_hid_node_t* next_node = NULL;
+    while (current_node != NULL) {
+        next_node = atomic_load(&(current_node->next));
+        if (atomic_load(&(current_node->is_marked_for_deletion)) && handle_raw_hid_device_missing(previous_node, current_node) == 1) {
+            if (verbose_basic) {
+                printf("Closed a missing raw HID device.\n");
+            }
+        } else {
+            previous_node = current_node;
+        }
+        current_node = next_node;
     }
+    raw_hid_node_reclaim();
 }
 
 // ============================================================================
-// raw_hid_message_t MEMORY MANAGEMENT (parent only)
+// HOTPLUG (linux only, child only)
 // ============================================================================
 
-void message_queue_push(int device_id, const unsigned char* data) {
-    if (!DEVICE_ID_IS_VALID(device_id)) {
+#ifdef USE_HOTPLUG_LINUX
+bool hotplug_init(void) {
+    // returns false if udev's events can't be subscribed to
+    hotplug_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    if (hotplug_fd < 0) {
+        return false;
+    }
+    struct sockaddr_nl address;
+    memset(&address, 0, sizeof(address));
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = HOTPLUG_NETLINK_GROUP_UDEV;
+    if (bind(hotplug_fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        close(hotplug_fd);
+        hotplug_fd = -1;
+        return false;
+    }
+    return true;
+}
+
+bool hotplug_parse_event(const char* buffer, size_t length, const char** action, const char** subsystem, const char** device_name) {
+    // points to the properties the hub needs, each one NULL if it's missing, returns false if it isn't udev's message
+    // udev's messages start with a header that says where the NUL separated KEY=value properties are
+    *action = NULL;
+    *subsystem = NULL;
+    *device_name = NULL;
+    uint32_t properties_offset;
+    uint32_t properties_length;
+    if (length < 24 || memcmp(buffer, "libudev", 8) != 0) {
+        return false;
+    }
+    memcpy(&properties_offset, buffer + 16, sizeof(properties_offset));
+    memcpy(&properties_length, buffer + 20, sizeof(properties_length));
+    if (properties_offset > length || properties_length > length - properties_offset) {
+        return false;
+    }
+    const char* property = buffer + properties_offset;
+    const char* end = property + properties_length;
+    while (property < end) {
+        size_t property_length = strnlen(property, end - property);
+        if (property_length == (size_t)(end - property)) {
+            // not NUL terminated
+            break;
+        }
+        if (strncmp(property, "ACTION=", 7) == 0) {
+            *action = property + 7;
+        } else if (strncmp(property, "SUBSYSTEM=", 10) == 0) {
+            *subsystem = property + 10;
+        } else if (strncmp(property, "DEVNAME=", 8) == 0) {
+            *device_name = property + 8;
+        }
+        property += property_length + 1;
+    }
+    return true;
+}
+
+bool hotplug_handle_event(const char* buffer, size_t length) {
+    // returns true if a hidraw node was added but couldn't be opened on its own, which leaves it to an enumeration
+    const char* action;
+    const char* subsystem;
+    const char* device_name;
+    if (!hotplug_parse_event(buffer, length, &action, &subsystem, &device_name) || action == NULL || subsystem == NULL || strcmp(subsystem, "hidraw") != 0) {
+        return false;
+    }
+    if (strcmp(action, "add") == 0) {
+        // udev gives the full path, the node's own name is what sysfs knows it by
+        const char* name = device_name != NULL ? strrchr(device_name, '/') : NULL;
+        return name == NULL || handle_hidraw_node(name + 1) < 0;
+    }
+    if (strcmp(action, "remove") == 0 && device_name != NULL) {
+        handle_raw_hid_device_removed(device_name);
+    }
+    return false;
+}
+
+bool hotplug_handle_events(int timeout_ms) {
+    // waits for events, returns true if any of them calls for an enumeration
+    struct pollfd poll_fd = {.fd = hotplug_fd, .events = POLLIN};
+    if (poll(&poll_fd, 1, timeout_ms) <= 0) {
+        return false;
+    }
+    static char buffer[HOTPLUG_BUFFER_SIZE];
+    bool needs_enumeration = false;
+    while (true) {
+        ssize_t length = recv(hotplug_fd, buffer, sizeof(buffer), 0);
+        if (length < 0) {
+            if (errno == ENOBUFS) {
+                // events were lost, so find out what's there the slow way
+                needs_enumeration = true;
+                continue;
+            }
+            break;
+        }
+        if (hotplug_handle_event(buffer, (size_t)length)) {
+            needs_enumeration = true;
+        }
+    }
+    return needs_enumeration;
+}
+#endif
+
+#ifdef USE_SYSFS_DISCOVERY_LINUX
+bool hotplug_init(void) {
+    // returns false if /dev can't be watched
+    hotplug_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (hotplug_fd < 0) {
+        return false;
+    }
+    // udev creates the node as root and sets its permissions after, which is an attribute change
+    if (inotify_add_watch(hotplug_fd, "/dev", IN_CREATE | IN_ATTRIB | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM) < 0) {
+        close(hotplug_fd);
+        hotplug_fd = -1;
+        return false;
+    }
+    return true;
+}
+
+bool hotplug_handle_events(int timeout_ms) {
+    // waits for events and opens or closes their hidraw nodes, returns true if events were lost
+    struct pollfd poll_fd = {.fd = hotplug_fd, .events = POLLIN};
+    if (poll(&poll_fd, 1, timeout_ms) <= 0) {
+        return false;
+    }
+    static _Alignas(struct inotify_event) char buffer[HOTPLUG_BUFFER_SIZE];
+    char path[MAX_DEVICE_PATH_LENGTH];
+    bool needs_enumeration = false;
+    ssize_t length;
+    while ((length = read(hotplug_fd, buffer, sizeof(buffer))) > 0) {
+        const char* current_event = buffer;
+        while (current_event < buffer + length) {
+            const struct inotify_event* event = (const struct inotify_event*)current_event;
+            current_event += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                needs_enumeration = true;
+            } else if (event->len > 0 && strncmp(event->name, "hidraw", 6) == 0) {
+                if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    snprintf(path, sizeof(path), "/dev/%s", event->name);
+                    handle_raw_hid_device_removed(path);
+                } else {
+                    // opening can fail until udev has set the permissions, the attribute change tries again
+                    handle_hidraw_node(event->name);
+                }
+            }
+        }
+    }
+    return needs_enumeration;
+}
+#endif
+
+#ifdef USE_HOTPLUG_EVENTS
+void hotplug_close(void) {
+    if (hotplug_fd >= 0) {
+        close(hotplug_fd);
+        hotplug_fd = -1;
+    }
+}
+
+void hotplug_loop(void) {
+    // enumerates at startup, when events call for it and every SECONDS_PER_SAFETY_ENUMERATION
+    uint64_t last_enumeration_ns = monotonic_time_ns();
+    enumerate_raw_hid_devices();
+    while (!atomic_load(&child_termination_flag)) {
+        // wake up once in a while to reap closed devices and check for termination
+        bool needs_enumeration = hotplug_handle_events(SECONDS_PER_ENUMERATION * 1000);
+        if (needs_enumeration || monotonic_time_ns() - last_enumeration_ns >= (uint64_t)SECONDS_PER_SAFETY_ENUMERATION * 1000000000) {
+            last_enumeration_ns = monotonic_time_ns();
+            enumerate_raw_hid_devices();
+        } else {
+            reap_raw_hid_devices();
+        }
+    }
+}
+#endif
+
+// ============================================================================
+// MESSAGE QUEUES (parent only)
+// ============================================================================
+
+raw_hid_message_t* message_new(void) {
+    // takes a message from this shard's pool, returns NULL if the pool is empty
+    raw_hid_message_t* message = pool_get(message_pool);
+    if (message != NULL) {
+        message->report_id_and_data[0] = QMK_RAW_HID_REPORT_ID;
+#ifdef USE_ROUTER_SHARDS
+        message->shard = current_shard;
+#else
+        message->shard = 0;
+#endif
+    }
+    return message;
+}
+
+void message_free(raw_hid_message_t* message) {
+    pool_put(&message_pools[message->shard], message);
+}
+
+bool message_queue_alloc(int device_id, raw_hid_node_t* node) {
+    // gives the device its ring of MESSAGE_QUEUE_CAPACITY message slots, returns false if the pool is empty
+    // only with the registry lock held
+    raw_hid_message_queue_t* queue = &(device_id_message_queue[device_id]);
+    queue->slots = pool_get(&message_queue_pool);
+    queue->head = 0;
+    queue->depth = 0;
+    queue->capacity = node->queue_capacity;
+    queue->control_head = 0;
+    queue->control_depth = 0;
+    queue->control_streak = 0;
+    queue->overflow_policy = node->overflow_policy;
+    queue->high_water_mark = 0;
+    queue->n_dropped = 0;
+    queue->n_late = 0;
+    queue->n_coalesced = 0;
+    queue->max_delay_ns = 0;
+#if QUEUE_DELAY_POLICY == QUEUE_DELAY_POLICY_CODEL
+    queue->codel_is_dropping = false;
+    queue->codel_first_above_ns = 0;
+    queue->codel_drop_next_ns = 0;
+    queue->codel_count = 0;
+    queue->codel_last_count = 0;
+#endif
+    return queue->slots != NULL;
+}
+
+bool message_queue_is_empty(int device_id) {
+    return !DEVICE_ID_IS_VALID(device_id) || (device_id_message_queue[device_id].depth == 0 && device_id_message_queue[device_id].control_depth == 0);
+}
+
+bool message_is_backpressure_notice(raw_hid_message_t* message) {
+#ifdef USE_BACKPRESSURE_NOTICES
+    return MESSAGE_DATA(message)[0] == BACKPRESSURE_NOTICE_COMMAND_ID;
+#else
+    (void)message;
+    return false;
+#endif
+}
+
+unsigned int message_queue_control_victim(raw_hid_message_queue_t* queue) {
+    // the oldest status report in a full control lane, or the oldest notice if there is none
+    for (unsigned int i = 0; i < queue->control_depth; i++) {
+        if (!message_is_backpressure_notice(queue->control_slots[(queue->control_head + i) & (CONTROL_QUEUE_CAPACITY - 1)])) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+void message_queue_push_control(int device_id, raw_hid_message_t* message) {
+    raw_hid_message_queue_t* queue = &(device_id_message_queue[device_id]);
+    if (queue->control_depth == CONTROL_QUEUE_CAPACITY) {
+        queue->n_dropped++;
+        if (verbose_stats) {
+            message_counter_increment_dropped(DEVICE_ID_HUB, device_id);
+        }
+        if (message_is_backpressure_notice(message)) {
+            // notices don't supersede anything, so a full lane just loses the new one
+            message_free(message);
+            return;
+        }
+        // a newer status report supersedes the oldest one, the later reports move up to close the gap
+        unsigned int victim = message_queue_control_victim(queue);
+        message_free(queue->control_slots[(queue->control_head + victim) & (CONTROL_QUEUE_CAPACITY - 1)]);
+        for (unsigned int i = victim; i + 1 < queue->control_depth; i++) {
+            queue->control_slots[(queue->control_head + i) & (CONTROL_QUEUE_CAPACITY - 1)] = queue->control_slots[(queue->control_head + i + 1) & (CONTROL_QUEUE_CAPACITY - 1)];
+        }
+        queue->control_depth--;
+        n_queued_messages--;
+    }
+    queue->control_slots[(queue->control_head + queue->control_depth) & (CONTROL_QUEUE_CAPACITY - 1)] = message;
+    queue->control_depth++;
+    n_queued_messages++;
+}
+
+#ifdef USE_BACKPRESSURE_NOTICES
+void backpressure_notify(int origin_device_id, int destination_device_id, unsigned char notice) {
+    // tells the origin that its report to the destination was dropped, at most once per interval
+    if (!DEVICE_ID_IS_VALID(origin_device_id)) {
         return;
     }
-    raw_hid_message_t* new_message = (raw_hid_message_t*)malloc(sizeof(raw_hid_message_t));
-    if (new_message == NULL) {
+    raw_hid_node_t* origin_node = atomic_load(&device_id_nodes[origin_device_id]);
+    if (origin_node == NULL) {
         return;
     }
-    memcpy(new_message->data, data, QMK_RAW_HID_REPORT_SIZE);
-    new_message->next = NULL;
-    if (device_id_message_queue[device_id] == NULL) {
-        device_id_message_queue[device_id] = new_message;
-    } else {
-        raw_hid_message_t* current_message = device_id_message_queue[device_id];
-        while (current_message->next != NULL) {
-            current_message = current_message->next;
+    // shards can drop reports from the same origin at the same time, only one of them gets to send the notice
+    uint64_t last_notice_time_ms = atomic_load(&backpressure_notice_time_ms[origin_device_id]);
+    if (current_time_ms - last_notice_time_ms < BACKPRESSURE_NOTICE_INTERVAL_MS || !atomic_compare_exchange_strong(&backpressure_notice_time_ms[origin_device_id], &last_notice_time_ms, current_time_ms)) {
+        return;
+    }
+    unsigned char data[QMK_RAW_HID_REPORT_SIZE] = {0};
+    data[0] = BACKPRESSURE_NOTICE_COMMAND_ID;
+    data[1] = DEVICE_ID_HUB;
+    data[2] = notice;
+    data[3] = (unsigned char)destination_device_id;
+    if (node_is_in_current_shard(origin_node)) {
+        raw_hid_message_t* message = message_new();
+        if (message == NULL) {
+            return;
+        }
+        message->time_ns = monotonic_time_ns();
+        memcpy(MESSAGE_DATA(message), data, QMK_RAW_HID_REPORT_SIZE);
+        message_queue_push_control(origin_device_id, message);
+    }
+#ifdef USE_MESSAGE_INBOXES
+    else {
+        // the origin's shard puts it in the control lane, a full inbox just loses the notice
+        raw_hid_report_t report;
+        report.time_ns = monotonic_time_ns();
+        report.length = QMK_RAW_HID_REPORT_SIZE;
+        memcpy(report.data, data, QMK_RAW_HID_REPORT_SIZE);
+        message_inbox_push(&(message_inboxes[origin_device_id]), &report);
+    }
+#endif
+    n_backpressure_notices_since_last_stats++;
+}
+#endif
+
+void message_queue_note_drop(int device_id, const unsigned char* data) {
+    // data[1] is the origin of every queued report
+    device_id_message_queue[device_id].n_dropped++;
+    if (verbose_stats) {
+        message_counter_increment_dropped(data[1], device_id);
+    }
+    if (verbose_discard) {
+        printf("Message queue for 0x%02hx is full, dropping report from 0x%02hx.\n", (unsigned char)device_id, data[1]);
+    }
+#ifdef USE_BACKPRESSURE_NOTICES
+    backpressure_notify(data[1], device_id, BACKPRESSURE_NOTICE_BUSY);
+#endif
+}
+
+void message_queue_drop_oldest(raw_hid_message_queue_t* queue) {
+    message_free(queue->slots[queue->head]);
+    queue->head = (queue->head + 1) & (MESSAGE_QUEUE_CAPACITY - 1);
+    queue->depth--;
+    n_queued_messages--;
+}
+
+#if MEMORY_BUDGET_KILOBYTES > 0
+void message_queue_shed(void) {
+    // messages are running low, so drop the oldest report from this shard's longest queue
+    int longest_device_id = DEVICE_ID_UNASSIGNED;
+    unsigned int longest_depth = 0;
+    for (int device_id = 0; device_id < N_UNIQUE_DEVICE_IDS; device_id++) {
+        // other shards' queues are theirs alone, so their depth can't even be looked at from here
+        if (!node_is_in_current_shard(atomic_load(&device_id_nodes[device_id]))) {
+            continue;
+        }
+        raw_hid_message_queue_t* queue = &(device_id_message_queue[device_id]);
+        // status reports from the hub are in the control lanes, which are never shed
+        if (queue->depth > longest_depth) {
+            longest_device_id = device_id;
+            longest_depth = queue->depth;
+        }
+    }
+    if (longest_device_id == DEVICE_ID_UNASSIGNED) {
+        return;
+    }
+    raw_hid_message_queue_t* queue = &(device_id_message_queue[longest_device_id]);
+    unsigned char origin_device_id = MESSAGE_DATA(queue->slots[queue->head])[1];
+    queue->n_dropped++;
+    n_shed_since_last_stats++;
+    if (verbose_stats) {
+        message_counter_increment_dropped(origin_device_id, longest_device_id);
+    }
+    if (verbose_discard) {
+        printf("Memory budget is used up, dropping the oldest report from 0x%02hx to 0x%02hx.\n", origin_device_id, (unsigned char)longest_device_id);
+    }
+#ifdef USE_BACKPRESSURE_NOTICES
+    backpressure_notify(origin_device_id, longest_device_id, BACKPRESSURE_NOTICE_BUSY);
+#endif
+    message_queue_drop_oldest(queue);
+}
+#endif
+
+#ifdef USE_COALESCING
+bool message_queue_coalesce(raw_hid_message_queue_t* queue, raw_hid_message_t* message) {
+    // puts the message in place of the queued one with the same origin and key, returns false if there is none
+    unsigned char* data = MESSAGE_DATA(message);
+    for (unsigned int i = 0; i < queue->depth; i++) {
+        raw_hid_message_t** slot = &(queue->slots[(queue->head + i) & (MESSAGE_QUEUE_CAPACITY - 1)]);
+        unsigned char* queued_data = MESSAGE_DATA(*slot);
+        if (queued_data[1] != data[1]) {
+            continue;
+        }
+        bool keys_match = true;
+        for (size_t j = 0; j < sizeof(coalescing_key_offsets) / sizeof(coalescing_key_offsets[0]); j++) {
+            if (queued_data[coalescing_key_offsets[j]] != data[coalescing_key_offsets[j]]) {
+                keys_match = false;
+                break;
+            }
+        }
+        if (keys_match) {
+            // takes over the old one's place in the queue
+            message_free(*slot);
+            *slot = message;
+            queue->n_coalesced++;
+            return true;
+        }
+    }
+    return false;
+}
+#endif
+
+bool message_queue_push(int device_id, raw_hid_message_t* message) {
+    // takes the message, unless the queue is full and its origin has to hold on to it, which returns false
+    if (!DEVICE_ID_IS_VALID(device_id) || device_id_message_queue[device_id].slots == NULL) {
+        message_free(message);
+        return true;
+    }
+    raw_hid_message_queue_t* queue = &(device_id_message_queue[device_id]);
+    unsigned char* data = MESSAGE_DATA(message);
+    if (data[1] == DEVICE_ID_HUB) {
+        message_queue_push_control(device_id, message);
+        return true;
+    }
+#ifdef USE_COALESCING
+    if (message_queue_coalesce(queue, message)) {
+        return true;
+    }
+#endif
+    if (queue->depth >= queue->capacity) {
+        if (queue->overflow_policy == OVERFLOW_POLICY_BLOCK_ORIGIN) {
+            return false;
+        }
+        if (queue->overflow_policy == OVERFLOW_POLICY_DROP_NEWEST) {
+            message_queue_note_drop(device_id, data);
+            message_free(message);
+            return true;
+        }
+        message_queue_note_drop(device_id, MESSAGE_DATA(queue->slots[queue->head]));
+        message_queue_drop_oldest(queue);
+    }
+#if MEMORY_BUDGET_KILOBYTES > 0
+    if (message_pool->n_blocks - atomic_load(&(message_pool->n_used)) < MESSAGE_POOL_RESERVE) {
+        message_queue_shed();
+    }
+#endif
+    queue->slots[(queue->head + queue->depth) & (MESSAGE_QUEUE_CAPACITY - 1)] = message;
+    queue->depth++;
+    if (queue->depth > queue->high_water_mark) {
+        queue->high_water_mark = queue->depth;
+    }
+    n_queued_messages++;
+    return true;
+}
+
+#if QUEUE_DELAY_POLICY == QUEUE_DELAY_POLICY_CODEL
+uint64_t integer_sqrt(uint64_t x) {
+    uint64_t root = 0;
+    uint64_t bit = 1ULL << 62;
+    while (bit > x) {
+        bit >>= 2;
+    }
+    while (bit != 0) {
+        if (x >= root + bit) {
+            x -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return root;
+}
+
+uint64_t codel_control_law(uint64_t time_ns, unsigned int count) {
+    // the gap between drops shrinks with the square root of the number of drops, sqrt is in 1/1024ths
+    return time_ns + (uint64_t)CODEL_INTERVAL_MICROSECONDS * 1000 * 1024 / integer_sqrt((uint64_t)count << 20);
+}
+#endif
+
+bool message_queue_is_late(raw_hid_message_queue_t* queue, uint64_t delay_ns, uint64_t now_ns) {
+    // decides whether the report that was just taken off the queue should be dropped
+#if QUEUE_DELAY_POLICY == QUEUE_DELAY_POLICY_TTL
+    (void)queue;
+    (void)now_ns;
+    return delay_ns > (uint64_t)QUEUE_DELAY_BUDGET_MICROSECONDS * 1000;
+#elif QUEUE_DELAY_POLICY == QUEUE_DELAY_POLICY_CODEL
+    // CoDel (RFC 8289) with reports instead of packets, but without its empty queue check,
+    // since every visit empties the queue even while the reports in it keep arriving late
+    bool ok_to_drop = false;
+    if (delay_ns < (uint64_t)QUEUE_DELAY_BUDGET_MICROSECONDS * 1000) {
+        queue->codel_first_above_ns = 0;
+    } else if (queue->codel_first_above_ns == 0) {
+        queue->codel_first_above_ns = now_ns + (uint64_t)CODEL_INTERVAL_MICROSECONDS * 1000;
+    } else if (now_ns >= queue->codel_first_above_ns) {
+        ok_to_drop = true;
+    }
+    if (queue->codel_is_dropping) {
+        if (!ok_to_drop) {
+            queue->codel_is_dropping = false;
+            return false;
+        }
+        if (now_ns >= queue->codel_drop_next_ns) {
+            queue->codel_count++;
+            queue->codel_drop_next_ns = codel_control_law(queue->codel_drop_next_ns, queue->codel_count);
+            return true;
+        }
+        return false;
+    }
+    if (ok_to_drop) {
+        // pick up where the last dropping state left off if it ended recently
+        queue->codel_is_dropping = true;
+        unsigned int delta = queue->codel_count - queue->codel_last_count;
+        if (delta > 1 && now_ns - queue->codel_drop_next_ns < (uint64_t)16 * CODEL_INTERVAL_MICROSECONDS * 1000) {
+            queue->codel_count = delta;
+        } else {
+            queue->codel_count = 1;
+        }
+        queue->codel_drop_next_ns = codel_control_law(now_ns, queue->codel_count);
+        queue->codel_last_count = queue->codel_count;
+        return true;
+    }
+    return false;
+#else
+    (void)queue;
+    (void)delay_ns;
+    (void)now_ns;
+    return false;
+#endif
+}
+
+raw_hid_message_t* message_queue_pop_control(raw_hid_message_queue_t* queue) {
+    raw_hid_message_t* message = queue->control_slots[queue->control_head];
+    queue->control_head = (queue->control_head + 1) & (CONTROL_QUEUE_CAPACITY - 1);
+    queue->control_depth--;
+    n_queued_messages--;
+    if (queue->depth > 0) {
+        queue->control_streak++;
+    }
+    return message;
+}
+
+raw_hid_message_t* message_queue_pop(int device_id) {
+    // the message belongs to the caller, returns NULL if the queue is empty or only held reports that were too late
+    if (message_queue_is_empty(device_id)) {
+        return NULL;
+    }
+    raw_hid_message_queue_t* queue = &(device_id_message_queue[device_id]);
+#if LANE_SCHEDULER == LANE_SCHEDULER_WEIGHTED
+    if (queue->control_depth > 0 && (queue->depth == 0 || queue->control_streak < CONTROL_LANE_WEIGHT)) {
+#else
+    if (queue->control_depth > 0) {
+#endif
+        return message_queue_pop_control(queue);
+    }
+    queue->control_streak = 0;
+    uint64_t now_ns = monotonic_time_ns();
+    while (queue->depth > 0) {
+        raw_hid_message_t* message = queue->slots[queue->head];
+        queue->head = (queue->head + 1) & (MESSAGE_QUEUE_CAPACITY - 1);
+        queue->depth--;
+        n_queued_messages--;
+        uint64_t delay_ns = now_ns - message->time_ns;
+        if (delay_ns > queue->max_delay_ns) {
+            queue->max_delay_ns = delay_ns;
+        }
+        if (!message_queue_is_late(queue, delay_ns, now_ns)) {
+            return message;
+        }
+        queue->n_late++;
+        if (verbose_discard) {
+            printf("Report from 0x%02hx to 0x%02hx waited %.3f ms, dropping it.\n", MESSAGE_DATA(message)[1], (unsigned char)device_id, delay_ns / 1e6);
         }
-        current_message->next = new_message;
+#ifdef USE_BACKPRESSURE_NOTICES
+        backpressure_notify(MESSAGE_DATA(message)[1], device_id, BACKPRESSURE_NOTICE_BUSY);
+#endif
+        message_free(message);
+    }
+    // status reports from the hub are never late
+    return queue->control_depth > 0 ? message_queue_pop_control(queue) : NULL;
+}
+
+void message_queue_unpop(int device_id, raw_hid_message_t* message) {
+    // puts the message that message_queue_pop just returned back at the head of its lane
+    raw_hid_message_queue_t* queue = &(device_id_message_queue[device_id]);
+    if (MESSAGE_DATA(message)[1] == DEVICE_ID_HUB) {
+        queue->control_head = (queue->control_head - 1) & (CONTROL_QUEUE_CAPACITY - 1);
+        queue->control_slots[queue->control_head] = message;
+        queue->control_depth++;
+    } else {
+        queue->head = (queue->head - 1) & (MESSAGE_QUEUE_CAPACITY - 1);
+        queue->slots[queue->head] = message;
+        queue->depth++;
+    }
+    n_queued_messages++;
+}
+
+void message_queue_clear(int device_id) {
+    // drops the queued reports and gives the slots back, only with the registry lock held
+    if (!DEVICE_ID_IS_VALID(device_id)) {
+        return;
+    }
+    raw_hid_message_queue_t* queue = &(device_id_message_queue[device_id]);
+    for (unsigned int i = 0; i < queue->depth; i++) {
+        message_free(queue->slots[(queue->head + i) & (MESSAGE_QUEUE_CAPACITY - 1)]);
+    }
+    for (unsigned int i = 0; i < queue->control_depth; i++) {
+        message_free(queue->control_slots[(queue->control_head + i) & (CONTROL_QUEUE_CAPACITY - 1)]);
+    }
+    n_queued_messages -= queue->depth + queue->control_depth;
+    pool_put(&message_queue_pool, queue->slots);
+    memset(queue, 0, sizeof(*queue));
+#ifdef USE_MESSAGE_INBOXES
+    raw_hid_report_t report;
+    while (message_inbox_peek(&(message_inboxes[device_id]), &report)) {
+        message_inbox_pop(&(message_inboxes[device_id]));
+    }
+#endif
+}
+
+void message_queue_clear_all(void) {
+    for (int device_id = 0; device_id < N_UNIQUE_DEVICE_IDS; device_id++) {
+        message_queue_clear(device_id);
+    }
+}
+
+#ifdef USE_MESSAGE_INBOXES
+bool message_inbox_inject(int destination_device_id, const raw_hid_report_t* report) {
+    // safe to call from any thread, leaves a report that is ready to be sent as is for the destination's shard,
+    // returns false if the destination isn't open or its inbox is full
+    if (!DEVICE_ID_IS_VALID(destination_device_id) || atomic_load(&device_id_nodes[destination_device_id]) == NULL) {
+        return false;
     }
+    if (!message_inbox_push(&(message_inboxes[destination_device_id]), report)) {
+        return false;
+    }
+#ifdef USE_MAIN_LOOP_WAKE
+    main_loop_wake();
+#endif
+    return true;
 }
 
-void message_queue_pop(int device_id, unsigned char* buffer) {
-    if (!DEVICE_ID_IS_VALID(device_id)) {
-        return;
+bool shard_route(int destination_device_id, raw_hid_message_t* message) {
+    // queues a message for a destination that may belong to another shard, returns false if it has to be held
+    raw_hid_node_t* destination_node = atomic_load(&device_id_nodes[destination_device_id]);
+    if (destination_node == NULL) {
+        message_free(message);
+        return true;
     }
-    if (device_id_message_queue[device_id] == NULL) {
-        return;
+    if (node_is_in_current_shard(destination_node)) {
+        return message_queue_push(destination_device_id, message);
+    }
+    // other shards have their own pools, so the report is copied into the inbox
+    raw_hid_report_t report;
+    report.time_ns = message->time_ns;
+    report.length = QMK_RAW_HID_REPORT_SIZE;
+    memcpy(report.data, MESSAGE_DATA(message), QMK_RAW_HID_REPORT_SIZE);
+    if (!message_inbox_inject(destination_device_id, &report)) {
+        // the origin holds on to it until the destination's shard catches up
+        n_inbox_full_since_last_stats++;
+        return false;
     }
-    raw_hid_message_t* popped_message = device_id_message_queue[device_id];
-    memcpy(buffer, popped_message->data, QMK_RAW_HID_REPORT_SIZE);
-    device_id_message_queue[device_id] = popped_message->next;
-    free(popped_message);
+    message_free(message);
+    return true;
 }
 
-void message_queue_clear(int device_id) {
+void message_inbox_drain(int device_id) {
+    // moves reports that other threads left for a device of this shard into its queue
     if (!DEVICE_ID_IS_VALID(device_id)) {
         return;
     }
-    raw_hid_message_t* current_message = device_id_message_queue[device_id];
-    raw_hid_message_t* previous_message = NULL;
-    while (current_message != NULL) {
-        previous_message = current_message;
-        current_message = current_message->next;
-        free(previous_message);
-    }
-    device_id_message_queue[device_id] = NULL;
-}
-
-void message_queue_clear_all(void) {
-    for (int device_id = 0; device_id < N_UNIQUE_DEVICE_IDS; device_id++) {
-        message_queue_clear(device_id);
+    raw_hid_message_inbox_t* inbox = &(message_inboxes[device_id]);
+    raw_hid_report_t report;
+    while (message_inbox_peek(inbox, &report)) {
+        raw_hid_message_t* message = message_new();
+        if (message == NULL) {
+            break;
+        }
+        message->time_ns = report.time_ns;
+        memcpy(MESSAGE_DATA(message), report.data, QMK_RAW_HID_REPORT_SIZE);
+        if (!message_queue_push(device_id, message)) {
+            // leave it in the inbox, which holds back the senders once the inbox fills up
+            message_free(message);
+            break;
+        }
+        message_inbox_pop(inbox);
+#ifdef USE_IDLE_TIERS
+        idle_tiers_note_activity();
+#endif
     }
 }
+#endif
 
 // ============================================================================
 // DEVICE REGISTRATION/UNREGISTRATION (parent only)
 // ============================================================================
 
+void registry_lock(void) {
+#ifdef USE_ROUTER_SHARDS
+    pthread_mutex_lock(&registry_mutex);
+#endif
+}
+
+void registry_unlock(void) {
+#ifdef USE_ROUTER_SHARDS
+    pthread_mutex_unlock(&registry_mutex);
+#endif
+}
+
+void mark_registrations_changed(void) {
+    registrations_changed = true;
+#ifdef USE_ROUTER_SHARDS
+    // every other shard picks this up at the start of its next iteration
+    seen_registration_generation = atomic_fetch_add(&registration_generation, 1) + 1;
+#endif
+}
+
 int register_node(raw_hid_node_t* node) {
     // returns 1 if the registration was successful, 0 if the node was already registered, -1 for error
     if (DEVICE_ID_IS_VALID(node->device_id)) {
         return 0;
     }
+    registry_lock();
     if (n_registered_devices == MAX_REGISTERED_DEVICES) {
+        registry_unlock();
         if (verbose_basic) {
             printf("Too many registered devices.\n");
         }
         return -1;
     }
+    if (!message_queue_alloc(next_unassigned_device_id, node)) {
+        registry_unlock();
+        printf("Error allocating message queue.\n");
+        return -1;
+    }
     node->device_id = next_unassigned_device_id;
-    device_id_is_assigned[next_unassigned_device_id] = true;
-    while (device_id_is_assigned[next_unassigned_device_id]) {
+    atomic_store(&device_id_is_assigned[next_unassigned_device_id], true);
+    atomic_store(&device_id_nodes[next_unassigned_device_id], node);
+    while (atomic_load(&device_id_is_assigned[next_unassigned_device_id])) {
         next_unassigned_device_id = (next_unassigned_device_id + 1) % N_UNIQUE_DEVICE_IDS;
     }
     assigned_device_ids[n_registered_devices] = node->device_id;
     n_registered_devices += 1;
+    mark_registrations_changed();
+    registry_unlock();
     if (verbose_basic) {
         printf("Device was registered with ID: 0x%02hx\n", node->device_id);
     }
-    registrations_changed = true;
     return 1;
 }
 
@@ -492,6 +3430,11 @@ void unregister_node(raw_hid_node_t* node) {
     if (verbose_basic) {
         printf("Device with ID 0x%02hx was unregistered.\n", node->device_id);
     }
+    if (node->held_message != NULL) {
+        message_free(node->held_message);
+        node->held_message = NULL;
+    }
+    registry_lock();
     message_queue_clear(node->device_id);
     for (int i = 0; i < n_registered_devices; i++) {
         if (assigned_device_ids[i] == node->device_id) {
@@ -500,37 +3443,212 @@ void unregister_node(raw_hid_node_t* node) {
             break;
         }
     }
+    atomic_store(&device_id_is_assigned[node->device_id], false);
+    atomic_store(&device_id_nodes[node->device_id], NULL);
     node->device_id = DEVICE_ID_UNASSIGNED;
-    device_id_is_assigned[node->device_id] = false;
     n_registered_devices -= 1;
-    registrations_changed = true;
+    mark_registrations_changed();
+    registry_unlock();
+}
+
+void handle_raw_hid_device_error(raw_hid_node_t* node) {
+    // unregisters a device whose reads or writes fail, it's most likely unplugged and its peers hear about it now
+    // instead of after the next enumeration, which only has to reap the node
+    if (atomic_load(&(node->is_marked_for_unregistration))) {
+        return;
+    }
+    if (verbose_basic) {
+        printf("Error communicating with a raw HID device, closing it.\n");
+    }
+    atomic_store(&(node->is_marked_for_unregistration), true);
+    unregister_node(node);
 }
 
 // ============================================================================
 // ACTUAL COMMUNICATION (parent only)
 // ============================================================================
 
+int read_from_raw_hid_device(raw_hid_node_t* node, raw_hid_message_t** message) {
+    // reads the next report into a message that belongs to the caller if bytes were read, returns the same as raw_hid_read()
+    if (spare_message == NULL) {
+        spare_message = message_new();
+        if (spare_message == NULL) {
+            // every message is queued or held, leave reports in the device until some are sent
+            reads_are_pending = true;
+            return 0;
+        }
+    }
+#ifdef USE_READ_RINGS
+    raw_hid_report_t report;
+    if (!report_ring_pop(&(node->reader_ring), &report)) {
+        return 0;
+    }
+    // the ring is how the report crosses over from the reader thread or the kernel, so it's copied once here
+    memcpy(MESSAGE_DATA(spare_message), report.data, QMK_RAW_HID_REPORT_SIZE);
+    spare_message->time_ns = report.time_ns;  // stamped by the reader thread or io_uring completion
+    *message = spare_message;
+    spare_message = NULL;
+    if (verbose_stats) {
+        uint64_t latency_ns = monotonic_time_ns() - report.time_ns;
+        ingress_reports_since_last_stats++;
+        ingress_latency_ns_since_last_stats += latency_ns;
+        if (latency_ns > ingress_max_latency_ns_since_last_stats) {
+            ingress_max_latency_ns_since_last_stats = latency_ns;
+        }
+    }
+    return report.length;
+#else
+    int bytes_read = raw_hid_read(node->device, MESSAGE_DATA(spare_message));
+    if (bytes_read > 0) {
+        spare_message->time_ns = monotonic_time_ns();
+        *message = spare_message;
+        spare_message = NULL;
+    }
+    return bytes_read;
+#endif
+}
+
+#ifdef USE_CUT_THROUGH
+bool cut_through_to_raw_hid_device(int destination_device_id, raw_hid_message_t* message) {
+    // returns true if the message was sent without going through the queue, the message still belongs to the caller
+    raw_hid_node_t* destination_node = atomic_load(&device_id_nodes[destination_device_id]);
+    if (!node_is_in_current_shard(destination_node) || atomic_load(&(destination_node->is_marked_for_unregistration))) {
+        // other shards' devices and queues are only touched by their own shard
+        return false;
+    }
+    if (!message_queue_is_empty(destination_device_id)) {
+        // don't overtake reports that are already waiting
+        return false;
+    }
+#if defined(USE_WRITER_THREADS_POSIX)
+    if (!writer_thread_push(destination_node, MESSAGE_DATA(message))) {
+        return false;
+    }
+#elif defined(USE_IO_URING_LINUX)
+    if (!io_uring_node_can_write(destination_node)) {
+        return false;
+    }
+    io_uring_node_write(destination_node, MESSAGE_DATA(message));
+#else
+    int bytes_written = raw_hid_write(destination_node->device, message->report_id_and_data);
+    if (bytes_written == 0) {
+        // busy, so it waits in the queue instead
+        return false;
+    }
+    if (bytes_written < 0) {
+        // the destination is unregistered when its shard gets to it
+        atomic_store(&(destination_node->has_io_error), true);
+    }
+#endif
+    if (verbose_device) {
+        printf("Sending to 0x%02hx:     ", destination_device_id);
+        print_buffer(MESSAGE_DATA(message));
+    }
+    return true;
+}
+#endif
+
+bool route_message(int destination_device_id, raw_hid_message_t* message) {
+    // sends or queues the message and takes it, unless the destination's queue is full and blocks its origin, which returns false
+#ifdef USE_CUT_THROUGH
+    if (cut_through_to_raw_hid_device(destination_device_id, message)) {
+        message_free(message);
+        return true;
+    }
+#endif
+#ifdef USE_MESSAGE_INBOXES
+    return shard_route(destination_device_id, message);
+#else
+    return message_queue_push(destination_device_id, message);
+#endif
+}
+
+bool release_held_message(raw_hid_node_t* node) {
+    // returns false while the message that a blocking queue turned away still doesn't fit
+    if (node->held_message == NULL) {
+        return true;
+    }
+    if (!atomic_load(&device_id_is_assigned[node->held_destination_device_id])) {
+#ifdef USE_BACKPRESSURE_NOTICES
+        backpressure_notify(node->device_id, node->held_destination_device_id, BACKPRESSURE_NOTICE_UNREACHABLE);
+#endif
+        message_free(node->held_message);
+    } else if (!route_message(node->held_destination_device_id, node->held_message)) {
+        return false;
+    }
+    node->held_message = NULL;
+    return true;
+}
+
+#if READ_SCHEDULER != READ_SCHEDULER_DRAIN
+bool read_budget_start_visit(raw_hid_node_t* node) {
+    // returns false if the device has to wait for a later visit
+#if READ_SCHEDULER == READ_SCHEDULER_DEFICIT_ROUND_ROBIN
+    node->read_deficit += READ_QUANTUM * node->read_weight;
+#else
+    node->read_deficit = READ_QUANTUM;
+#endif
+    if (node->read_deficit < 1) {
+        // low weights take several visits to earn a single read
+        reads_are_pending = true;
+        return false;
+    }
+    return true;
+}
+
+bool read_budget_take(raw_hid_node_t* node) {
+    // returns false once the budget for this visit is used up
+    node->read_deficit -= 1;
+    if (node->read_deficit < 1) {
+        node->n_read_budgets_exhausted++;
+        reads_are_pending = true;
+        return false;
+    }
+    return true;
+}
+
+void read_budget_end_visit(raw_hid_node_t* node, int bytes_read) {
+    // a device that ran dry doesn't get to save up its budget
+    if (bytes_read <= 0 && node->read_deficit >= 1) {
+        node->read_deficit = 0;
+    }
+}
+#endif
+
 void communicate_with_raw_hid_device(raw_hid_node_t* node) {
 
-    // read from device
-    int bytes_read = hid_read(node->device, buffer_data, QMK_RAW_HID_REPORT_SIZE);
+    // read from device, unless it's still holding a report for a full queue
+    int bytes_read = 0;
+    raw_hid_message_t* message = NULL;  // the report is rewritten in place and forwarded from here
+    unsigned char* data;
+    if (release_held_message(node)) {
+#if READ_SCHEDULER != READ_SCHEDULER_DRAIN
+        bytes_read = read_budget_start_visit(node) ? read_from_raw_hid_device(node, &message) : 0;
+#else
+        bytes_read = read_from_raw_hid_device(node, &message);
+#endif
+    }
     int result;
     unsigned char destination_device_id;
     while (bytes_read > 0) {
-        if (buffer_data[0] != RAW_HID_HUB_COMMAND_ID) {
+        data = MESSAGE_DATA(message);
+        if (data[0] != RAW_HID_HUB_COMMAND_ID) {
             if (verbose_discard) {
                 printf("Discarding:          ");
-                print_buffer();
+                print_buffer(data);
             }
             goto next_hid_read;
         } else {
-            if ((verbose_hub && buffer_data[1] == DEVICE_ID_HUB)) {
+            if ((verbose_hub && data[1] == DEVICE_ID_HUB)) {
                 printf("Receiving from 0x%02hx: ", node->device_id);
-                print_buffer();
+                print_buffer(data);
             }
+#ifdef USE_IDLE_TIERS
+            idle_tiers_note_activity();
+#endif
 
             // registration report
-            if (buffer_data[1] == DEVICE_ID_HUB && buffer_data[2] == 0x01) {
+            if (data[1] == DEVICE_ID_HUB && data[2] == 0x01) {
                 if (verbose_stats) {
                     message_counter_increment(node->device_id, DEVICE_ID_HUB);
                 }
@@ -538,17 +3656,21 @@ void communicate_with_raw_hid_device(raw_hid_node_t* node) {
                 if (result == 0) {
                     // registrations didn't change, so respond to only this device
                     destination_device_id = node->device_id;
-                    buffer_data[0] = RAW_HID_HUB_COMMAND_ID;
-                    buffer_data[1] = DEVICE_ID_HUB;
-                    memcpy(buffer_data + 2, assigned_device_ids, MAX_REGISTERED_DEVICES);
+                    data[0] = RAW_HID_HUB_COMMAND_ID;
+                    data[1] = DEVICE_ID_HUB;
+                    registry_lock();
+                    memcpy(data + 2, assigned_device_ids, MAX_REGISTERED_DEVICES);
                     for (int j = 3; j < n_registered_devices + 2; j++) {
-                        if (buffer_data[j] == destination_device_id) {
-                            buffer_data[j] = buffer_data[2];
-                            buffer_data[2] = destination_device_id;
+                        if (data[j] == destination_device_id) {
+                            data[j] = data[2];
+                            data[2] = destination_device_id;
                             break;
                         }
                     }
-                    message_queue_push(destination_device_id, buffer_data);
+                    registry_unlock();
+                    // the reply goes out in the registration report's own message
+                    message_queue_push(destination_device_id, message);
+                    message = NULL;
                     if (verbose_stats) {
                         message_counter_increment(DEVICE_ID_HUB, destination_device_id);
                     }
@@ -562,7 +3684,7 @@ void communicate_with_raw_hid_device(raw_hid_node_t* node) {
             }
 
             // unregistration report
-            if (buffer_data[1] == DEVICE_ID_HUB && buffer_data[2] == 0x00) {
+            if (data[1] == DEVICE_ID_HUB && data[2] == 0x00) {
                 if (verbose_stats) {
                     message_counter_increment(node->device_id, DEVICE_ID_HUB);
                 }
@@ -571,89 +3693,292 @@ void communicate_with_raw_hid_device(raw_hid_node_t* node) {
             }
 
             // message report
-            if (buffer_data[1] != DEVICE_ID_HUB) {
-                destination_device_id = buffer_data[1]; 
-                if (!device_id_is_assigned[destination_device_id]) {
+            if (data[1] != DEVICE_ID_HUB) {
+                destination_device_id = data[1]; 
+                if (!atomic_load(&device_id_is_assigned[destination_device_id])) {
+#ifdef USE_BACKPRESSURE_NOTICES
+                    backpressure_notify(node->device_id, destination_device_id, BACKPRESSURE_NOTICE_UNREACHABLE);
+#endif
                     goto next_hid_read;
                 }
-                buffer_data[0] = RAW_HID_HUB_COMMAND_ID;
-                buffer_data[1] = node->device_id;
-                message_queue_push(destination_device_id, buffer_data);
+                data[0] = RAW_HID_HUB_COMMAND_ID;
+                data[1] = node->device_id;
                 if (verbose_stats) {
                     message_counter_increment(node->device_id, destination_device_id);
                 }
-#if (defined(_WIN32) && defined(USE_SMART_SLEEP_WINDOWS)) || (!defined(_WIN32) && defined(USE_SMART_SLEEP_POSIX))
-                last_message_time_ms = current_time_ms;
-#endif
+                if (!route_message(destination_device_id, message)) {
+                    // stop reading from this device until the destination has room
+                    node->held_message = message;
+                    node->held_destination_device_id = destination_device_id;
+                    message = NULL;
+                    break;
+                }
+                message = NULL;
                 goto next_hid_read;
             }
 
 next_hid_read:
-        bytes_read = hid_read(node->device, buffer_data, QMK_RAW_HID_REPORT_SIZE);
+        if (message != NULL) {
+            // reports that weren't forwarded are done with here
+            message_free(message);
+            message = NULL;
+        }
+#if READ_SCHEDULER != READ_SCHEDULER_DRAIN
+        if (!read_budget_take(node)) {
+            break;
+        }
+#endif
+        bytes_read = read_from_raw_hid_device(node, &message);
 
         }
     }
+#if READ_SCHEDULER != READ_SCHEDULER_DRAIN
+    read_budget_end_visit(node, bytes_read);
+#endif
+    if (bytes_read < 0) {
+        handle_raw_hid_device_error(node);
+        return;
+    }
 
     // queue up status reports
     if (registrations_changed) {
+        uint64_t status_time_ns = monotonic_time_ns();
+        registry_lock();
         for (int i = 0; i < n_registered_devices; i++) {
             destination_device_id = assigned_device_ids[i];
-            buffer_data[0] = RAW_HID_HUB_COMMAND_ID;
-            buffer_data[1] = DEVICE_ID_HUB;
-            memcpy(buffer_data + 2, assigned_device_ids, MAX_REGISTERED_DEVICES);
+            if (!node_is_in_current_shard(atomic_load(&device_id_nodes[destination_device_id]))) {
+                // the device's own shard sends its status report
+                continue;
+            }
+            message = message_new();
+            if (message == NULL) {
+                printf("Error allocating status report for 0x%02hx.\n", destination_device_id);
+                continue;
+            }
+            message->time_ns = status_time_ns;
+            data = MESSAGE_DATA(message);
+            data[0] = RAW_HID_HUB_COMMAND_ID;
+            data[1] = DEVICE_ID_HUB;
+            memcpy(data + 2, assigned_device_ids, MAX_REGISTERED_DEVICES);
             for (int j = 3; j < n_registered_devices + 2; j++) {
-                if (buffer_data[j] == destination_device_id) {
-                    buffer_data[j] = buffer_data[2];
-                    buffer_data[2] = destination_device_id;
+                if (data[j] == destination_device_id) {
+                    data[j] = data[2];
+                    data[2] = destination_device_id;
                     break;
                 }
             }
-            message_queue_push(destination_device_id, buffer_data);
+            message_queue_push(destination_device_id, message);
             if (verbose_stats) {
                 message_counter_increment(DEVICE_ID_HUB, destination_device_id);
             }
         }
+        registry_unlock();
         registrations_changed = false;
     }
 
     // send to device
-    while (device_id_message_queue[node->device_id] != NULL) {
-        message_queue_pop(node->device_id, buffer_data);
-        if ((verbose_hub && buffer_data[1] == DEVICE_ID_HUB) || (verbose_device && buffer_data[1] != DEVICE_ID_HUB)) {
+    while (!message_queue_is_empty(node->device_id)) {
+#if defined(USE_WRITER_THREADS_POSIX)
+        if (report_ring_is_full(&(node->writer_ring))) {
+            // leave the rest queued until the writer catches up
+            atomic_fetch_add(&(node->writer_stats.n_full), 1);
+            writers_are_backlogged = true;
+            break;
+        }
+#elif defined(USE_IO_URING_LINUX)
+        if (!io_uring_node_can_write(node)) {
+            // leave the rest queued until the writes in flight complete
+            writers_are_backlogged = true;
+            break;
+        }
+#endif
+        message = message_queue_pop(node->device_id);
+        if (message == NULL) {
+            // everything left was too late
+            break;
+        }
+        data = MESSAGE_DATA(message);
+        if ((verbose_hub && data[1] == DEVICE_ID_HUB) || (verbose_device && data[1] != DEVICE_ID_HUB)) {
             printf("Sending to 0x%02hx:     ", node->device_id);
-            print_buffer();
+            print_buffer(data);
+        }
+#if defined(USE_WRITER_THREADS_POSIX)
+        writer_thread_push(node, data);
+#elif defined(USE_IO_URING_LINUX)
+        io_uring_node_write(node, data);
+#else
+        result = raw_hid_write(node->device, message->report_id_and_data);
+        if (result == 0) {
+            // busy, so it stays first in line until the next visit
+            message_queue_unpop(node->device_id, message);
+#    ifdef USE_HIDRAW_FD
+            writers_are_backlogged = true;
+#    endif
+            break;
+        }
+        if (result < 0) {
+            message_free(message);
+            handle_raw_hid_device_error(node);
+            return;
         }
-        hid_write(node->device, buffer_report_id_and_data, QMK_RAW_HID_REPORT_SIZE + 1);
+#endif
+        message_free(message);
     }
 }
 
 void iterate_over_raw_hid_devices(void) {
+#if defined(USE_WRITER_THREADS_POSIX) || defined(USE_HIDRAW_FD)
+    writers_are_backlogged = false;
+#endif
+    reads_are_pending = false;
+#ifdef USE_ROUTER_SHARDS
+    unsigned int generation = atomic_load(&registration_generation);
+    if (generation != seen_registration_generation) {
+        seen_registration_generation = generation;
+        registrations_changed = true;
+    }
+#endif
     raw_hid_node_t* current_node = atomic_load(&raw_hid_nodes);
     while (current_node != NULL) {
+#ifdef USE_ROUTER_SHARDS
+        if (current_node->shard != current_shard) {
+            current_node = atomic_load(&(current_node->next));
+            continue;
+        }
+#endif
+        if (atomic_load(&(current_node->has_io_error))) {
+            // a reader or writer thread, an io_uring completion or another shard saw the device fail
+            handle_raw_hid_device_error(current_node);
+        }
         if (atomic_load((&(current_node->is_marked_for_unregistration)))) {
             unregister_node(current_node);
+#ifdef USE_IO_URING_LINUX
+            // the child can't free the node while the kernel is still using its buffers
+            atomic_store((&(current_node->is_marked_for_deletion)), io_uring_node_retire(current_node));
+#else
+#    ifdef USE_EPOLL_LINUX
+            if (!atomic_load(&(current_node->is_marked_for_deletion))) {
+                // the parent stops reading here, so the fd can't be left to wake every wait until the child frees the node
+                event_loop_remove_node(current_node);
+            }
+#    endif
             atomic_store((&(current_node->is_marked_for_deletion)), true);
+#endif
         } else {
+#ifdef USE_MESSAGE_INBOXES
+            message_inbox_drain(current_node->device_id);
+#endif
+#ifdef USE_EPOLL_LINUX
+            // skip devices that have nothing to read and nothing to send
+            if (current_node->is_readable || registrations_changed || !message_queue_is_empty(current_node->device_id)) {
+                current_node->is_readable = false;
+                communicate_with_raw_hid_device(current_node);
+            }
+#elif defined(USE_IO_URING_LINUX)
+            // skip devices that have nothing to read and nothing to send
+            if (!report_ring_is_empty(&(current_node->reader_ring)) || registrations_changed || !message_queue_is_empty(current_node->device_id)) {
+                communicate_with_raw_hid_device(current_node);
+            }
+            io_uring_node_start_read(current_node);
+#else
             communicate_with_raw_hid_device(current_node);
+#endif
         }
         current_node = atomic_load(&(current_node->next));
     }
-    atomic_store(&main_loop_new_iteration_flag, true);
+}
+
+void leave_raw_hid_nodes(void) {
+    // the shard holds on to no node from here until its next iteration, so nodes unlinked before now can be freed
+#ifdef USE_ROUTER_SHARDS
+    atomic_store(&(shard_epochs[current_shard].epoch), atomic_load(&node_epoch));
+#else
+    atomic_store(&(shard_epochs[0].epoch), atomic_load(&node_epoch));
+#endif
 }
 
 void send_hub_shutdown_reports(void) {
-    buffer_data[0] = RAW_HID_HUB_COMMAND_ID;
-    buffer_data[1] = DEVICE_ID_HUB;
-    buffer_data[2] = DEVICE_ID_UNASSIGNED;
+    unsigned char report_id_and_data[QMK_RAW_HID_REPORT_SIZE + 1] = {0};
+    report_id_and_data[0] = QMK_RAW_HID_REPORT_ID;
+    report_id_and_data[1] = RAW_HID_HUB_COMMAND_ID;
+    report_id_and_data[2] = DEVICE_ID_HUB;
+    report_id_and_data[3] = DEVICE_ID_UNASSIGNED;
     raw_hid_node_t* current_node = atomic_load(&raw_hid_nodes);
     while (current_node != NULL) {
         if (DEVICE_ID_IS_VALID(current_node->device_id)) {
-            hid_write(current_node->device, buffer_report_id_and_data, QMK_RAW_HID_REPORT_SIZE + 1);
+            raw_hid_write(current_node->device, report_id_and_data);
         }
         current_node = atomic_load(&(current_node->next));
     }
 }
 
+// ============================================================================
+// LOW LATENCY MODE
+// ============================================================================
+
+void pin_current_thread(int cpu) {
+    if (cpu < 0) {
+        return;
+    }
+#if defined(_WIN32)
+    if (SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) == 0 && verbose_basic) {
+        printf("Couldn't pin thread to CPU %d.\n", cpu);
+    }
+#elif defined(__linux__)
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpu, &cpu_set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) != 0 && verbose_basic) {
+        printf("Couldn't pin thread to CPU %d.\n", cpu);
+    }
+#else
+    if (verbose_basic) {
+        printf("Pinning threads to CPUs isn't supported on this platform.\n");
+    }
+#endif
+}
+
+void make_current_thread_realtime(int priority) {
+    if (priority <= 0) {
+        return;
+    }
+#ifdef _WIN32
+    if (!SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL) && verbose_basic) {
+        printf("Couldn't raise thread priority.\n");
+    }
+#else
+    struct sched_param param = {.sched_priority = priority};
+    int result = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (result != 0 && verbose_basic) {
+        printf("Couldn't switch to SCHED_FIFO with priority %d: %s.\n", priority, strerror(result));
+    }
+#endif
+}
+
+void lock_memory(void) {
+    // page faults in the main loop would undo everything else
+#ifndef _WIN32
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0 && verbose_basic) {
+        printf("Couldn't lock memory: %s.\n", strerror(errno));
+    }
+#endif
+}
+
+void enter_low_latency_mode(void) {
+    // called from the main loop's thread
+#ifdef USE_ROUTER_SHARDS
+    // shards take consecutive cpus
+    pin_current_thread(low_latency_main_cpu < 0 ? -1 : low_latency_main_cpu + current_shard);
+#else
+    pin_current_thread(low_latency_main_cpu);
+#endif
+    make_current_thread_realtime(low_latency_priority);
+    lock_memory();
+    if (verbose_basic) {
+        printf("Entered low latency mode.\n");
+    }
+}
+
 // ============================================================================
 // CHILD PROCESS FOR ENUMERATION
 // ============================================================================
@@ -666,6 +3991,9 @@ pthread_t child_thread;
 
 #ifdef _WIN32
 void child_process(void) {
+    if (low_latency_mode) {
+        pin_current_thread(low_latency_enumeration_cpu);
+    }
     while (!atomic_load(&child_termination_flag)) {
         enumerate_raw_hid_devices();
         Sleep(SECONDS_PER_ENUMERATION * 1000);
@@ -673,10 +4001,24 @@ void child_process(void) {
 }
 #else
 void* child_process(void* arg) {
+    if (low_latency_mode) {
+        pin_current_thread(low_latency_enumeration_cpu);
+    }
+#ifdef USE_HOTPLUG_EVENTS
+    if (hotplug_init()) {
+        hotplug_loop();
+        hotplug_close();
+        return NULL;
+    }
+    if (verbose_basic) {
+        printf("Error subscribing to hotplug events, enumerating every %d seconds instead.\n", SECONDS_PER_ENUMERATION);
+    }
+#endif
     while (!atomic_load(&child_termination_flag)) {
         enumerate_raw_hid_devices();
         sleep_milliseconds(SECONDS_PER_ENUMERATION * 1000);
     }
+    return NULL;
 }
 #endif
 
@@ -697,7 +4039,6 @@ void start_child(void) {
 }
 
 void stop_child(void) {
-    atomic_store(&main_loop_new_iteration_flag, true);
     atomic_store(&child_termination_flag, true);
 #ifdef _WIN32
     if (hChildProcess != NULL) {
@@ -715,11 +4056,22 @@ void stop_child(void) {
 // ============================================================================
 
 void cleanup(void) {
+#ifdef USE_ALLOCATION_CHECK_LINUX
+    // signals without router shards clean up from inside the main loop
+    allocations_are_checked = false;
+#endif
+#ifdef USE_ROUTER_SHARDS
+    stop_shards();
+#endif
     send_hub_shutdown_reports();
     stop_child();
+#if defined(USE_EPOLL_LINUX) || defined(USE_IO_URING_LINUX)
+    event_loop_free();  // before the nodes, since io_uring may still be using their buffers
+#endif
     raw_hid_node_free_all();
     message_queue_clear_all();
     message_counter_free_all();
+    pools_free_all();
     hid_exit();
     if (verbose_basic) {
         printf("Cleanup completed.\n");
@@ -727,20 +4079,23 @@ void cleanup(void) {
 }
 
 void signal_handler(int signal) {
+#ifdef USE_ROUTER_SHARDS
+    // another shard may be waiting on a lock that this thread holds, so let shard 0 leave its loop and clean up in main
+    (void)signal;
+    atomic_store(&shard_termination_flag, true);
+#else
     cleanup();
     exit(signal);
+#endif
 }
 
 // ============================================================================
 // MAIN
 // ============================================================================
 
-void parse_verbose(int argc, char* argv[]) {
+void parse_verbose(const char* arg) {
     // crude parser for verbose argument
-    uint8_t verbose = 0;
-    if (argc > 1 && strncmp(argv[1], "-v", 2) == 0) {
-        verbose = atoi(&argv[1][2]);
-    }
+    uint8_t verbose = atoi(&arg[2]);
     if (verbose > 0) {
         printf("Verbose:\n");
         if (verbose % 2 == 1) {
@@ -770,29 +4125,140 @@ void parse_verbose(int argc, char* argv[]) {
     }
 }
 
+void parse_low_latency(const char* arg) {
+    // -l, optionally followed by <main cpu>,<enumeration cpu>,<priority>
+    low_latency_mode = true;
+    sscanf(&arg[2], "%d,%d,%d", &low_latency_main_cpu, &low_latency_enumeration_cpu, &low_latency_priority);
+}
+
+void parse_arguments(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "-v", 2) == 0) {
+            parse_verbose(argv[i]);
+        } else if (strncmp(argv[i], "-l", 2) == 0) {
+            parse_low_latency(argv[i]);
+        }
+    }
+}
+
 void main_sleep(void) {
-#if defined(USE_SLEEP_WINDOWS) && defined(_WIN32)
-#    ifdef USE_SMART_SLEEP_WINDOWS
-        if (last_message_time_ms - current_time_ms > SMART_SLEEP_WAIT_MILLISECONDS_WINDOWS) {
+#if defined(USE_MAIN_LOOP_WAKE)
+    event_loop_wait();  // polls without blocking in low latency mode
+#elif defined(USE_SLEEP_WINDOWS) && defined(_WIN32)
+        if (low_latency_mode) {
+            return;  // busy-poll
+        }
+#    ifdef USE_IDLE_TIERS_WINDOWS
+        if (idle_tier == IDLE_TIER_WARM) {
             Sleep(SLEEP_MILLISECONDS_WINDOWS);
+        } else if (idle_tier == IDLE_TIER_COLD) {
+            Sleep(COLD_SLEEP_MILLISECONDS_WINDOWS);
         }
 #    else
         Sleep(SLEEP_MILLISECONDS_WINDOWS);
 #    endif
 #elif defined(USE_SLEEP_POSIX) && !defined(_WIN32)
-#    ifdef USE_SMART_SLEEP_POSIX
-        if (last_message_time_ms - current_time_ms > SMART_SLEEP_WAIT_MILLISECONDS_POSIX) {
-            sleep_milliseconds(SLEEP_MILLISECONDS_POSIX);
+        if (low_latency_mode) {
+            return;  // busy-poll
+        }
+#    ifdef USE_IDLE_TIERS_POSIX
+        if (idle_tier == IDLE_TIER_WARM) {
+            sleep_one_tick();
+        } else if (idle_tier == IDLE_TIER_COLD) {
+            sleep_milliseconds(COLD_SLEEP_MILLISECONDS_POSIX);
+        }
+#        ifdef USE_PRECISION_TICK_POSIX
+        if (idle_tier != IDLE_TIER_WARM) {
+            tick_scheduler_reset();
         }
+#        endif
 #    else
-        sleep_milliseconds(SLEEP_MILLISECONDS_POSIX);
+        sleep_one_tick();
 #    endif
 #endif
 }
 
+void main_loop_init(void) {
+    // state that every shard keeps for itself, called from the thread that runs the loop
+#ifdef USE_ROUTER_SHARDS
+    message_pool = &message_pools[current_shard];
+    message_counter_pool = &message_counter_pools[current_shard];
+#else
+    message_pool = &message_pools[0];
+    message_counter_pool = &message_counter_pools[0];
+#endif
+    update_current_time_ms();
+    last_stats_time_ms = current_time_ms;
+    last_message_time_ms = current_time_ms;
+#ifdef USE_IDLE_TIERS
+    idle_tier_last_update_ms = current_time_ms;
+#endif
+#ifdef USE_PRECISION_TICK_POSIX
+    tick_scheduler_init();
+#endif
+    if (low_latency_mode) {
+        enter_low_latency_mode();
+    }
+}
+
+void main_loop(void) {
+#ifdef USE_ALLOCATION_CHECK_LINUX
+    allocations_are_checked = true;
+#endif
+#ifdef USE_ROUTER_SHARDS
+    while (!atomic_load(&shard_termination_flag)) {
+#else
+    while (true) {
+#endif
+
+        // update time
+        update_current_time_ms();
+#ifdef USE_IDLE_TIERS
+        idle_tiers_update();
+#endif
+
+        // actual hid task
+        iterate_over_raw_hid_devices();
+
+        // print stats
+        maybe_print_and_update_stats();
+        leave_raw_hid_nodes();
+
+        // sleep to reduce resource usage
+        main_sleep();
+    }
+#ifdef USE_ALLOCATION_CHECK_LINUX
+    allocations_are_checked = false;
+#endif
+}
+
+#ifdef USE_ROUTER_SHARDS
+void* shard_thread(void* arg) {
+    current_shard = (int)(intptr_t)arg;
+    main_loop_init();
+    main_loop();
+    message_counter_free_all();
+    return NULL;
+}
+
+void start_shards(void) {
+    // shard 0 is the main thread
+    for (int shard = 1; shard < ROUTER_SHARDS; shard++) {
+        if (pthread_create(&shard_threads[shard], NULL, shard_thread, (void*)(intptr_t)shard) != 0) {
+            printf("Error creating router shard thread.");
+            exit(1);
+        }
+    }
+}
+#endif
+
 int main(int argc, char* argv[])
 {
-    parse_verbose(argc, argv);
+#ifdef USE_ALLOCATION_CHECK_LINUX
+    // before anything is printed, with the same buffering stdio would have picked
+    setvbuf(stdout, stdout_buffer, isatty(STDOUT_FILENO) ? _IOLBF : _IOFBF, sizeof(stdout_buffer));
+#endif
+    parse_arguments(argc, argv);
 
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
@@ -813,33 +4279,32 @@ int main(int argc, char* argv[])
 
     // initialize global variables
     memset(device_id_is_assigned, false, sizeof(device_id_is_assigned));
+    memset(device_id_nodes, 0, sizeof(device_id_nodes));
     memset(assigned_device_ids, DEVICE_ID_UNASSIGNED, sizeof(assigned_device_ids));
-    memset(buffer_report_id_and_data, 0, sizeof(buffer_report_id_and_data));
     memset(device_id_message_queue, 0, sizeof(device_id_message_queue));
-    buffer_report_id_and_data[0] = QMK_RAW_HID_REPORT_ID;
-    buffer_data = buffer_report_id_and_data + 1;
-    update_current_time_ms();
-    last_stats_time_ms = current_time_ms;
-    last_message_time_ms = current_time_ms;
+#ifdef USE_MESSAGE_INBOXES
+    for (int device_id = 0; device_id < N_UNIQUE_DEVICE_IDS; device_id++) {
+        message_inbox_init(&(message_inboxes[device_id]));
+    }
+#endif
+    if (!pools_init()) {
+        printf("Error allocating pools.\n");
+        pools_free_all();
+        hid_exit();
+        return -1;
+    }
+#if defined(USE_EPOLL_LINUX) || defined(USE_IO_URING_LINUX)
+    event_loop_init();
+#endif
 
     // start a child thread to run periodic enumerations
     start_child();
+#ifdef USE_ROUTER_SHARDS
+    start_shards();
+#endif
 
-    // main loop
-    while (true) {
-
-        // update time
-        update_current_time_ms();
-
-        // actual hid task
-        iterate_over_raw_hid_devices();
-
-        // print stats
-        maybe_print_and_update_stats();
-
-        // sleep to reduce resource usage
-        main_sleep();
-    }
+    main_loop_init();
+    main_loop();
     
     // cleanup
     cleanup();
@@ -0,0 +1,89 @@
+// ============================================================================
+// COALESCING TEST
+// ============================================================================
+
+// queues reports whose origin and key bytes (COALESCING_KEY_OFFSETS, {2} by default) match or differ, and checks that
+// only a report with the same origin and key takes over a queued one's place, and that status reports never do
+
+#define USE_COALESCING
+#define main raw_hid_hub_main
+#include "../raw_hid_hub.c"
+#undef main
+
+#define TEST_DESTINATION_DEVICE_ID 7
+#define TEST_ORIGIN_DEVICE_ID 3
+#define TEST_OTHER_ORIGIN_DEVICE_ID 4
+
+int n_failures = 0;
+
+void expect(bool condition, const char* what) {
+    if (!condition) {
+        printf("%s.\n", what);
+        n_failures++;
+    }
+}
+
+raw_hid_message_t* test_message(unsigned char origin_device_id, unsigned char key, unsigned char value) {
+    // the key is the first byte after the device id, the value the one after that
+    raw_hid_message_t* message = message_new();
+    memset(MESSAGE_DATA(message), 0, QMK_RAW_HID_REPORT_SIZE);
+    MESSAGE_DATA(message)[0] = RAW_HID_HUB_COMMAND_ID;
+    MESSAGE_DATA(message)[1] = origin_device_id;
+    MESSAGE_DATA(message)[2] = key;
+    MESSAGE_DATA(message)[3] = value;
+    message->time_ns = monotonic_time_ns();
+    return message;
+}
+
+void expect_pop(unsigned char origin_device_id, unsigned char key, unsigned char value, const char* what) {
+    raw_hid_message_t* message = message_queue_pop(TEST_DESTINATION_DEVICE_ID);
+    unsigned char* data = message != NULL ? MESSAGE_DATA(message) : NULL;
+    expect(data != NULL && data[1] == origin_device_id && data[2] == key && data[3] == value, what);
+    if (message != NULL) {
+        message_free(message);
+    }
+}
+
+int main(void) {
+    if (!pools_init()) {
+        printf("Error allocating the pools.\n");
+        return 1;
+    }
+    main_loop_init();
+    raw_hid_node_t node;
+    memset(&node, 0, sizeof(node));
+    node.queue_capacity = MESSAGE_QUEUE_CAPACITY;
+    node.overflow_policy = OVERFLOW_POLICY_DROP_NEWEST;
+    if (!message_queue_alloc(TEST_DESTINATION_DEVICE_ID, &node)) {
+        printf("Error allocating the queue.\n");
+        return 1;
+    }
+    raw_hid_message_queue_t* queue = &(device_id_message_queue[TEST_DESTINATION_DEVICE_ID]);
+
+    // a different key or a different origin joins the end of the queue, the same origin and key takes the old one's place
+    message_queue_push(TEST_DESTINATION_DEVICE_ID, test_message(TEST_ORIGIN_DEVICE_ID, 1, 10));
+    message_queue_push(TEST_DESTINATION_DEVICE_ID, test_message(TEST_ORIGIN_DEVICE_ID, 2, 20));
+    message_queue_push(TEST_DESTINATION_DEVICE_ID, test_message(TEST_OTHER_ORIGIN_DEVICE_ID, 1, 30));
+    message_queue_push(TEST_DESTINATION_DEVICE_ID, test_message(TEST_ORIGIN_DEVICE_ID, 1, 11));
+    message_queue_push(TEST_DESTINATION_DEVICE_ID, test_message(TEST_ORIGIN_DEVICE_ID, 1, 12));
+    expect(queue->depth == 3, "Reports with the same origin and key weren't coalesced");
+    expect(queue->n_coalesced == 2, "Coalesced reports weren't counted");
+
+    // status reports from the hub are never coalesced
+    message_queue_push(TEST_DESTINATION_DEVICE_ID, test_message(DEVICE_ID_HUB, 1, 40));
+    message_queue_push(TEST_DESTINATION_DEVICE_ID, test_message(DEVICE_ID_HUB, 1, 40));
+    expect(queue->control_depth == 2, "Status reports were coalesced");
+
+    expect_pop(DEVICE_ID_HUB, 1, 40, "The first status report didn't go first");
+    expect_pop(DEVICE_ID_HUB, 1, 40, "The second status report didn't go second");
+    expect_pop(TEST_ORIGIN_DEVICE_ID, 1, 12, "The newest report didn't take the oldest one's place");
+    expect_pop(TEST_ORIGIN_DEVICE_ID, 2, 20, "A report with a different key was coalesced");
+    expect_pop(TEST_OTHER_ORIGIN_DEVICE_ID, 1, 30, "A report from a different origin was coalesced");
+    expect(message_queue_is_empty(TEST_DESTINATION_DEVICE_ID), "The queue still holds reports");
+
+    message_queue_clear(TEST_DESTINATION_DEVICE_ID);
+    expect(atomic_load(&(message_pool->n_used)) == 0 && n_queued_messages == 0, "Replaced reports were leaked");
+    pools_free_all();
+    printf("Coalescing, %d failures.\n", n_failures);
+    return n_failures == 0 ? 0 : 1;
+}
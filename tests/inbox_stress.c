@@ -0,0 +1,103 @@
+// ============================================================================
+// MESSAGE INBOX STRESS TEST
+// ============================================================================
+
+// several producer threads inject numbered reports into one destination's inbox while a single
+// consumer takes them out, every report has to arrive exactly once and in its producer's order
+
+#define USE_MESSAGE_INBOXES
+#define main raw_hid_hub_main
+#include "../raw_hid_hub.c"
+#undef main
+
+#define STRESS_PRODUCERS 4
+#define STRESS_REPORTS_PER_PRODUCER 200000
+#define STRESS_DESTINATION_DEVICE_ID 7
+
+raw_hid_node_t stress_destination_node;
+atomic_int n_finished_producers = 0;
+
+void stress_write_sequence(unsigned char* data, uint32_t sequence) {
+    data[2] = (unsigned char)(sequence >> 24);
+    data[3] = (unsigned char)(sequence >> 16);
+    data[4] = (unsigned char)(sequence >> 8);
+    data[5] = (unsigned char)sequence;
+}
+
+uint32_t stress_read_sequence(const unsigned char* data) {
+    return ((uint32_t)data[2] << 24) | ((uint32_t)data[3] << 16) | ((uint32_t)data[4] << 8) | (uint32_t)data[5];
+}
+
+void* stress_producer(void* arg) {
+    int producer = (int)(intptr_t)arg;
+    raw_hid_report_t report;
+    memset(&report, 0, sizeof(report));
+    report.length = QMK_RAW_HID_REPORT_SIZE;
+    report.data[0] = RAW_HID_HUB_COMMAND_ID;
+    report.data[1] = (unsigned char)producer;
+    for (uint32_t sequence = 0; sequence < STRESS_REPORTS_PER_PRODUCER; sequence++) {
+        stress_write_sequence(report.data, sequence);
+        report.time_ns = sequence;
+        while (!message_inbox_inject(STRESS_DESTINATION_DEVICE_ID, &report)) {
+            // the inbox is full, wait for the consumer
+            sched_yield();
+        }
+    }
+    atomic_fetch_add(&n_finished_producers, 1);
+    return NULL;
+}
+
+int main(void) {
+    raw_hid_message_inbox_t* inbox = &(message_inboxes[STRESS_DESTINATION_DEVICE_ID]);
+    message_inbox_init(inbox);
+    atomic_store(&device_id_nodes[STRESS_DESTINATION_DEVICE_ID], &stress_destination_node);
+
+    pthread_t producers[STRESS_PRODUCERS];
+    for (int producer = 0; producer < STRESS_PRODUCERS; producer++) {
+        if (pthread_create(&producers[producer], NULL, stress_producer, (void*)(intptr_t)producer) != 0) {
+            printf("Error creating producer thread.\n");
+            return 1;
+        }
+    }
+
+    uint32_t next_sequence[STRESS_PRODUCERS] = {0};
+    uint64_t n_received = 0;
+    uint64_t n_failures = 0;
+    raw_hid_report_t report;
+    while (n_received < (uint64_t)STRESS_PRODUCERS * STRESS_REPORTS_PER_PRODUCER) {
+        if (!message_inbox_peek(inbox, &report)) {
+            // a lost claim leaves a cell that never fills, so stop waiting once every producer is done
+            if (atomic_load(&n_finished_producers) == STRESS_PRODUCERS && !message_inbox_peek(inbox, &report)) {
+                printf("%llu reports never arrived.\n", (unsigned long long)STRESS_PRODUCERS * STRESS_REPORTS_PER_PRODUCER - n_received);
+                n_failures++;
+                break;
+            }
+            sched_yield();
+            continue;
+        }
+        message_inbox_pop(inbox);
+        n_received++;
+        int producer = report.data[1];
+        uint32_t sequence = stress_read_sequence(report.data);
+        if (producer >= STRESS_PRODUCERS || report.data[0] != RAW_HID_HUB_COMMAND_ID || report.length != QMK_RAW_HID_REPORT_SIZE) {
+            printf("Report %llu is corrupt.\n", (unsigned long long)n_received);
+            n_failures++;
+            continue;
+        }
+        if (sequence != next_sequence[producer] || report.time_ns != sequence) {
+            printf("Producer %d: expected report %u, got %u.\n", producer, next_sequence[producer], sequence);
+            n_failures++;
+        }
+        next_sequence[producer] = sequence + 1;
+    }
+
+    for (int producer = 0; producer < STRESS_PRODUCERS; producer++) {
+        pthread_join(producers[producer], NULL);
+    }
+    if (message_inbox_peek(inbox, &report)) {
+        printf("The inbox still holds reports after every producer finished.\n");
+        n_failures++;
+    }
+    printf("%llu reports from %d producers, %llu failures.\n", (unsigned long long)n_received, STRESS_PRODUCERS, (unsigned long long)n_failures);
+    return n_failures == 0 ? 0 : 1;
+}
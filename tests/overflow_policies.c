@@ -0,0 +1,96 @@
+// ============================================================================
+// OVERFLOW POLICY TEST
+// ============================================================================
+
+// fills a small queue past its capacity under each overflow policy and checks which reports are left,
+// that status reports from the hub still get in, and that every message goes back to the pool
+
+#define main raw_hid_hub_main
+#include "../raw_hid_hub.c"
+#undef main
+
+#define TEST_QUEUE_CAPACITY 4
+#define TEST_N_REPORTS 6
+#define TEST_DESTINATION_DEVICE_ID 7
+#define TEST_ORIGIN_DEVICE_ID 3
+
+int n_failures = 0;
+
+void expect(bool condition, const char* policy_name, const char* what) {
+    if (!condition) {
+        printf("%s: %s.\n", policy_name, what);
+        n_failures++;
+    }
+}
+
+raw_hid_message_t* test_message(unsigned char origin_device_id, unsigned char sequence) {
+    raw_hid_message_t* message = message_new();
+    memset(MESSAGE_DATA(message), 0, QMK_RAW_HID_REPORT_SIZE);
+    MESSAGE_DATA(message)[0] = RAW_HID_HUB_COMMAND_ID;
+    MESSAGE_DATA(message)[1] = origin_device_id;
+    MESSAGE_DATA(message)[2] = sequence;
+    message->time_ns = monotonic_time_ns();
+    return message;
+}
+
+void test_overflow_policy(int overflow_policy, const char* policy_name, unsigned char first_left, unsigned int n_dropped) {
+    raw_hid_node_t node;
+    memset(&node, 0, sizeof(node));
+    node.queue_capacity = TEST_QUEUE_CAPACITY;
+    node.overflow_policy = overflow_policy;
+    if (!message_queue_alloc(TEST_DESTINATION_DEVICE_ID, &node)) {
+        expect(false, policy_name, "the queue couldn't be allocated");
+        return;
+    }
+    raw_hid_message_queue_t* queue = &(device_id_message_queue[TEST_DESTINATION_DEVICE_ID]);
+
+    // the origin keeps whatever the queue refuses
+    unsigned int n_refused = 0;
+    for (unsigned char sequence = 0; sequence < TEST_N_REPORTS; sequence++) {
+        raw_hid_message_t* message = test_message(TEST_ORIGIN_DEVICE_ID, sequence);
+        if (!message_queue_push(TEST_DESTINATION_DEVICE_ID, message)) {
+            message_free(message);
+            n_refused++;
+        }
+    }
+    expect(queue->depth == TEST_QUEUE_CAPACITY, policy_name, "the queue isn't full");
+    expect(queue->n_dropped == n_dropped, policy_name, "wrong number of dropped reports");
+    expect(n_refused == (overflow_policy == OVERFLOW_POLICY_BLOCK_ORIGIN ? TEST_N_REPORTS - TEST_QUEUE_CAPACITY : 0), policy_name, "wrong number of refused reports");
+
+    // a full queue never keeps status reports out, and they go first
+    expect(message_queue_push(TEST_DESTINATION_DEVICE_ID, test_message(DEVICE_ID_HUB, 0xFF)), policy_name, "a status report was refused");
+    raw_hid_message_t* message = message_queue_pop(TEST_DESTINATION_DEVICE_ID);
+    expect(message != NULL && MESSAGE_DATA(message)[1] == DEVICE_ID_HUB, policy_name, "the status report didn't go first");
+    if (message != NULL) {
+        message_free(message);
+    }
+
+    for (unsigned char sequence = first_left; sequence < first_left + TEST_QUEUE_CAPACITY; sequence++) {
+        message = message_queue_pop(TEST_DESTINATION_DEVICE_ID);
+        if (message == NULL) {
+            expect(false, policy_name, "the queue ran out early");
+            break;
+        }
+        expect(MESSAGE_DATA(message)[2] == sequence, policy_name, "the queued reports are the wrong ones or out of order");
+        message_free(message);
+    }
+    expect(message_queue_is_empty(TEST_DESTINATION_DEVICE_ID), policy_name, "the queue still holds reports");
+    message_queue_clear(TEST_DESTINATION_DEVICE_ID);
+    expect(atomic_load(&(message_pool->n_used)) == 0 && n_queued_messages == 0, policy_name, "messages were leaked");
+}
+
+int main(void) {
+    if (!pools_init()) {
+        printf("Error allocating the pools.\n");
+        return 1;
+    }
+    main_loop_init();
+
+    test_overflow_policy(OVERFLOW_POLICY_DROP_NEWEST, "drop newest", 0, TEST_N_REPORTS - TEST_QUEUE_CAPACITY);
+    test_overflow_policy(OVERFLOW_POLICY_DROP_OLDEST, "drop oldest", TEST_N_REPORTS - TEST_QUEUE_CAPACITY, TEST_N_REPORTS - TEST_QUEUE_CAPACITY);
+    test_overflow_policy(OVERFLOW_POLICY_BLOCK_ORIGIN, "block origin", 0, 0);
+
+    pools_free_all();
+    printf("3 overflow policies, %d failures.\n", n_failures);
+    return n_failures == 0 ? 0 : 1;
+}
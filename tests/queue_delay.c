@@ -0,0 +1,136 @@
+// ============================================================================
+// QUEUE DELAY POLICY TEST
+// ============================================================================
+
+// built once with QUEUE_DELAY_POLICY_TTL and once with QUEUE_DELAY_POLICY_CODEL, feeds the policy made up delays
+// and times and checks which reports it drops, then takes late reports off a real queue
+
+#define main raw_hid_hub_main
+#include "../raw_hid_hub.c"
+#undef main
+
+#define TEST_DESTINATION_DEVICE_ID 7
+#define TEST_ORIGIN_DEVICE_ID 3
+#define TEST_BUDGET_NS ((uint64_t)QUEUE_DELAY_BUDGET_MICROSECONDS * 1000)
+#define TEST_INTERVAL_NS ((uint64_t)CODEL_INTERVAL_MICROSECONDS * 1000)
+#define TEST_MILLISECOND_NS 1000000ULL
+
+int n_failures = 0;
+
+void expect(bool condition, const char* what) {
+    if (!condition) {
+        printf("%s.\n", what);
+        n_failures++;
+    }
+}
+
+raw_hid_message_t* test_message(unsigned char origin_device_id, unsigned char sequence, uint64_t time_ns) {
+    raw_hid_message_t* message = message_new();
+    memset(MESSAGE_DATA(message), 0, QMK_RAW_HID_REPORT_SIZE);
+    MESSAGE_DATA(message)[0] = RAW_HID_HUB_COMMAND_ID;
+    MESSAGE_DATA(message)[1] = origin_device_id;
+    MESSAGE_DATA(message)[2] = sequence;
+    message->time_ns = time_ns;
+    return message;
+}
+
+#if QUEUE_DELAY_POLICY == QUEUE_DELAY_POLICY_TTL
+void test_drop_decisions(void) {
+    // every report that waited longer than the budget is dropped, no matter what came before
+    raw_hid_message_queue_t queue;
+    memset(&queue, 0, sizeof(queue));
+    uint64_t now_ns = 1000 * TEST_MILLISECOND_NS;
+    expect(!message_queue_is_late(&queue, 0, now_ns), "TTL dropped a report that didn't wait");
+    expect(!message_queue_is_late(&queue, TEST_BUDGET_NS, now_ns), "TTL dropped a report that waited exactly the budget");
+    expect(message_queue_is_late(&queue, TEST_BUDGET_NS + 1, now_ns), "TTL kept a report that waited longer than the budget");
+    expect(message_queue_is_late(&queue, TEST_BUDGET_NS + 1, now_ns + 1), "TTL kept the second late report in a row");
+    expect(!message_queue_is_late(&queue, TEST_BUDGET_NS - 1, now_ns + 2), "TTL dropped a report after a late one");
+}
+#elif QUEUE_DELAY_POLICY == QUEUE_DELAY_POLICY_CODEL
+void test_drop_decisions(void) {
+    // nothing is dropped until the delay stayed above the budget for an interval, then drops come closer together
+    // with the square root of their count, and a delay under the budget ends it
+    raw_hid_message_queue_t queue;
+    memset(&queue, 0, sizeof(queue));
+    uint64_t late_ns = TEST_BUDGET_NS + TEST_MILLISECOND_NS;
+    uint64_t start_ns = 1000 * TEST_MILLISECOND_NS;
+    expect(!message_queue_is_late(&queue, late_ns, start_ns), "CoDel dropped the first late report");
+    expect(!message_queue_is_late(&queue, late_ns, start_ns + TEST_INTERVAL_NS - 1), "CoDel dropped before the interval was over");
+    expect(message_queue_is_late(&queue, late_ns, start_ns + TEST_INTERVAL_NS), "CoDel didn't drop once the interval was over");
+    expect(queue.codel_is_dropping && queue.codel_count == 1, "CoDel didn't start dropping");
+    expect(!message_queue_is_late(&queue, late_ns, start_ns + TEST_INTERVAL_NS + 1), "CoDel dropped twice in a row");
+
+    // the second drop is a whole interval after the first, the third one interval / sqrt(2) after that
+    uint64_t second_drop_ns = start_ns + 2 * TEST_INTERVAL_NS;
+    expect(!message_queue_is_late(&queue, late_ns, second_drop_ns - 1), "CoDel dropped the second report too early");
+    expect(message_queue_is_late(&queue, late_ns, second_drop_ns), "CoDel didn't drop the second report");
+    uint64_t third_drop_ns = second_drop_ns + TEST_INTERVAL_NS * 1000 / 1414;
+    expect(!message_queue_is_late(&queue, late_ns, third_drop_ns - TEST_MILLISECOND_NS), "CoDel dropped the third report too early");
+    expect(message_queue_is_late(&queue, late_ns, third_drop_ns + TEST_MILLISECOND_NS), "CoDel didn't drop the third report");
+    expect(queue.codel_count == 3, "CoDel lost count of its drops");
+
+    // one report under the budget ends the dropping state and the interval starts over
+    uint64_t now_ns = third_drop_ns + 2 * TEST_MILLISECOND_NS;
+    expect(!message_queue_is_late(&queue, TEST_BUDGET_NS - 1, now_ns), "CoDel dropped a report under the budget");
+    expect(!queue.codel_is_dropping, "CoDel kept dropping after a report under the budget");
+    expect(!message_queue_is_late(&queue, late_ns, now_ns + 1), "CoDel dropped without waiting for a new interval");
+
+    // coming back soon after picks up near the old drop rate instead of starting from one
+    expect(message_queue_is_late(&queue, late_ns, now_ns + 1 + TEST_INTERVAL_NS), "CoDel didn't drop again after an interval");
+    expect(queue.codel_count == 2, "CoDel didn't pick up where it left off");
+}
+#else
+#    error "build this test with QUEUE_DELAY_POLICY_TTL or QUEUE_DELAY_POLICY_CODEL"
+#endif
+
+void test_late_reports(void) {
+    // reports that waited far too long are dropped when they're taken off the queue, status reports never are
+    raw_hid_node_t node;
+    memset(&node, 0, sizeof(node));
+    node.queue_capacity = MESSAGE_QUEUE_CAPACITY;
+    node.overflow_policy = OVERFLOW_POLICY_DROP_NEWEST;
+    if (!message_queue_alloc(TEST_DESTINATION_DEVICE_ID, &node)) {
+        expect(false, "The queue couldn't be allocated");
+        return;
+    }
+    raw_hid_message_queue_t* queue = &(device_id_message_queue[TEST_DESTINATION_DEVICE_ID]);
+    uint64_t stale_time_ns = monotonic_time_ns() - 10 * (TEST_BUDGET_NS + TEST_INTERVAL_NS);
+
+    // CoDel only drops once the delay stayed too long for an interval, so it gets to see that first
+#if QUEUE_DELAY_POLICY == QUEUE_DELAY_POLICY_CODEL
+    queue->codel_first_above_ns = 1;
+#endif
+    message_queue_push(TEST_DESTINATION_DEVICE_ID, test_message(TEST_ORIGIN_DEVICE_ID, 0, stale_time_ns));
+    message_queue_push(TEST_DESTINATION_DEVICE_ID, test_message(TEST_ORIGIN_DEVICE_ID, 1, monotonic_time_ns()));
+    raw_hid_message_t* message = message_queue_pop(TEST_DESTINATION_DEVICE_ID);
+    expect(message != NULL && MESSAGE_DATA(message)[2] == 1, "The late report wasn't dropped");
+    expect(queue->n_late == 1, "The late report wasn't counted");
+    if (message != NULL) {
+        message_free(message);
+    }
+
+    message_queue_push(TEST_DESTINATION_DEVICE_ID, test_message(DEVICE_ID_HUB, 0xFF, stale_time_ns));
+    message = message_queue_pop(TEST_DESTINATION_DEVICE_ID);
+    expect(message != NULL && MESSAGE_DATA(message)[1] == DEVICE_ID_HUB, "A late status report was dropped");
+    if (message != NULL) {
+        message_free(message);
+    }
+
+    message_queue_clear(TEST_DESTINATION_DEVICE_ID);
+    expect(atomic_load(&(message_pool->n_used)) == 0 && n_queued_messages == 0, "Messages were leaked");
+}
+
+int main(void) {
+    if (!pools_init()) {
+        printf("Error allocating the pools.\n");
+        return 1;
+    }
+    main_loop_init();
+
+    test_drop_decisions();
+    test_late_reports();
+
+    pools_free_all();
+    printf("Queue delay policy %d, %d failures.\n", QUEUE_DELAY_POLICY, n_failures);
+    return n_failures == 0 ? 0 : 1;
+}
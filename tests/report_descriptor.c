@@ -0,0 +1,88 @@
+// ============================================================================
+// REPORT DESCRIPTOR TEST
+// ============================================================================
+
+// looks for usages in real and made up report descriptors and in every truncation of them, each one at the very end
+// of its own allocation so that reading past it shows up under AddressSanitizer
+
+#define USE_SYSFS_DISCOVERY_LINUX
+#define main raw_hid_hub_main
+#include "../raw_hid_hub.c"
+#undef main
+
+int n_failures = 0;
+
+// what QMK sends for its raw hid interface
+const unsigned char qmk_raw_hid_descriptor[] = {
+    0x06, 0x60, 0xFF,  // usage page (0xFF60)
+    0x09, 0x61,        // usage (0x61)
+    0xA1, 0x01,        // collection (application)
+    0x09, 0x62,        //   usage (0x62)
+    0x15, 0x00,        //   logical minimum (0)
+    0x26, 0xFF, 0x00,  //   logical maximum (255)
+    0x95, 0x20,        //   report count (32)
+    0x75, 0x08,        //   report size (8)
+    0x81, 0x02,        //   input (data, variable, absolute)
+    0x09, 0x63,        //   usage (0x63)
+    0x15, 0x00,        //   logical minimum (0)
+    0x26, 0xFF, 0x00,  //   logical maximum (255)
+    0x95, 0x20,        //   report count (32)
+    0x75, 0x08,        //   report size (8)
+    0x91, 0x02,        //   output (data, variable, absolute)
+    0xC0,              // end collection
+};
+
+void expect_usage(const unsigned char* descriptor, size_t length, unsigned int usage_page, unsigned int usage, bool has_usage, const char* what) {
+    unsigned char* buffer = malloc(length > 0 ? length : 1);
+    memcpy(buffer, descriptor, length);
+    if (report_descriptor_has_usage(buffer, length, usage_page, usage) != has_usage) {
+        printf("%s.\n", what);
+        n_failures++;
+    }
+    free(buffer);
+}
+
+#define DESCRIPTOR(...) (const unsigned char[]){__VA_ARGS__}, sizeof((const unsigned char[]){__VA_ARGS__})
+
+void test_descriptors(void) {
+    expect_usage(qmk_raw_hid_descriptor, sizeof(qmk_raw_hid_descriptor), QMK_RAW_HID_USAGE_PAGE, QMK_RAW_HID_USAGE, true, "QMK's raw hid descriptor wasn't found");
+    expect_usage(qmk_raw_hid_descriptor, sizeof(qmk_raw_hid_descriptor), QMK_RAW_HID_USAGE_PAGE, 0x62, false, "A usage inside the collection was taken for the collection's");
+    expect_usage(qmk_raw_hid_descriptor, sizeof(qmk_raw_hid_descriptor), 0x0001, QMK_RAW_HID_USAGE, false, "A usage was found under the wrong usage page");
+    expect_usage(qmk_raw_hid_descriptor, 0, QMK_RAW_HID_USAGE_PAGE, QMK_RAW_HID_USAGE, false, "An empty descriptor had a usage");
+
+    // a keyboard with raw hid as its second top level collection
+    expect_usage(DESCRIPTOR(0x05, 0x01, 0x09, 0x06, 0xA1, 0x01, 0x05, 0x07, 0x81, 0x02, 0xC0, 0x06, 0x60, 0xFF, 0x09, 0x61, 0xA1, 0x01, 0xC0), QMK_RAW_HID_USAGE_PAGE, QMK_RAW_HID_USAGE, true, "The second top level collection wasn't looked at");
+    expect_usage(DESCRIPTOR(0x05, 0x01, 0x09, 0x06, 0xA1, 0x01, 0x05, 0x07, 0x81, 0x02, 0xC0, 0x06, 0x60, 0xFF, 0x09, 0x61, 0xA1, 0x01, 0xC0), 0x0001, 0x0006, true, "The first top level collection wasn't looked at");
+
+    // only top level collections count, and only the first usage since the last main item
+    expect_usage(DESCRIPTOR(0x06, 0x60, 0xFF, 0x09, 0x01, 0xA1, 0x01, 0x09, 0x61, 0xA1, 0x00, 0xC0, 0xC0), QMK_RAW_HID_USAGE_PAGE, QMK_RAW_HID_USAGE, false, "A nested collection was taken for a top level one");
+    expect_usage(DESCRIPTOR(0x06, 0x60, 0xFF, 0x09, 0x61, 0x09, 0x62, 0xA1, 0x01, 0xC0), QMK_RAW_HID_USAGE_PAGE, 0x62, false, "The second usage was taken for the collection's");
+    expect_usage(DESCRIPTOR(0x06, 0x60, 0xFF, 0x09, 0x61, 0x81, 0x02, 0xA1, 0x01, 0xC0), QMK_RAW_HID_USAGE_PAGE, QMK_RAW_HID_USAGE, false, "A usage that an input item used up was taken for the collection's");
+    expect_usage(DESCRIPTOR(0x06, 0x60, 0xFF, 0x09, 0x61, 0x05, 0x01, 0xA1, 0x01, 0xC0), QMK_RAW_HID_USAGE_PAGE, QMK_RAW_HID_USAGE, true, "A later usage page changed an earlier usage");
+    expect_usage(DESCRIPTOR(0xC0, 0xC0, 0x06, 0x60, 0xFF, 0x09, 0x61, 0xA1, 0x01, 0xC0), QMK_RAW_HID_USAGE_PAGE, QMK_RAW_HID_USAGE, true, "Stray end collections threw off the depth");
+
+    // a 4 byte usage brings its own usage page, long items are skipped
+    expect_usage(DESCRIPTOR(0x05, 0x01, 0x0B, 0x61, 0x00, 0x60, 0xFF, 0xA1, 0x01, 0xC0), QMK_RAW_HID_USAGE_PAGE, QMK_RAW_HID_USAGE, true, "A 4 byte usage wasn't found");
+    expect_usage(DESCRIPTOR(0xFE, 0x02, 0x00, 0x09, 0x61, 0x06, 0x60, 0xFF, 0x09, 0x61, 0xA1, 0x01, 0xC0), QMK_RAW_HID_USAGE_PAGE, QMK_RAW_HID_USAGE, true, "A long item wasn't skipped");
+    expect_usage(DESCRIPTOR(0xFE, 0x40, 0x00, 0x06, 0x60, 0xFF, 0x09, 0x61, 0xA1, 0x01, 0xC0), QMK_RAW_HID_USAGE_PAGE, QMK_RAW_HID_USAGE, false, "Items inside a long item were parsed");
+    expect_usage(DESCRIPTOR(0xFE), QMK_RAW_HID_USAGE_PAGE, QMK_RAW_HID_USAGE, false, "A long item without its size had a usage");
+}
+
+void test_truncations(void) {
+    // the usage only counts once its collection item is complete
+    size_t collection_end = 7;
+    for (size_t length = 0; length <= sizeof(qmk_raw_hid_descriptor); length++) {
+        expect_usage(qmk_raw_hid_descriptor, length, QMK_RAW_HID_USAGE_PAGE, QMK_RAW_HID_USAGE, length >= collection_end, "A truncated descriptor was misread");
+    }
+    const unsigned char items[] = {0x06, 0x60, 0xFF, 0x0B, 0x61, 0x00, 0x60, 0xFF, 0xFE, 0x10, 0x00, 0x27, 0x01, 0x02, 0x03, 0x04};
+    for (size_t length = 0; length <= sizeof(items); length++) {
+        expect_usage(items, length, QMK_RAW_HID_USAGE_PAGE, QMK_RAW_HID_USAGE, false, "A truncated descriptor without a collection had a usage");
+    }
+}
+
+int main(void) {
+    test_descriptors();
+    test_truncations();
+    printf("Report descriptors, %d failures.\n", n_failures);
+    return n_failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,127 @@
+// ============================================================================
+// UDEV EVENT TEST
+// ============================================================================
+
+// feeds the netlink property parser well formed, truncated and made up udev messages, each one at the very end of
+// its own allocation so that reading past it shows up under AddressSanitizer, then removes devices through it
+
+#define USE_HOTPLUG_LINUX
+#define main raw_hid_hub_main
+#include "../raw_hid_hub.c"
+#undef main
+
+#define TEST_HEADER_SIZE 40  // like udev's own, the properties follow right after
+
+int n_failures = 0;
+raw_hid_node_t test_node;
+raw_hid_node_t test_deleted_node;
+
+void expect(bool condition, const char* what) {
+    if (!condition) {
+        printf("%s.\n", what);
+        n_failures++;
+    }
+}
+
+bool property_is(const char* property, const char* value) {
+    return property != NULL && value != NULL ? strcmp(property, value) == 0 : property == value;
+}
+
+char* test_event(const char* properties, size_t properties_length, uint32_t properties_offset, uint32_t header_properties_length, size_t* length) {
+    // returns an allocation that holds nothing but the message
+    *length = TEST_HEADER_SIZE + properties_length;
+    char* buffer = malloc(*length);
+    memset(buffer, 0, TEST_HEADER_SIZE);
+    memcpy(buffer, "libudev", 8);
+    memcpy(buffer + 16, &properties_offset, sizeof(properties_offset));
+    memcpy(buffer + 20, &header_properties_length, sizeof(header_properties_length));
+    memcpy(buffer + TEST_HEADER_SIZE, properties, properties_length);
+    return buffer;
+}
+
+char* test_udev_event(const char* properties, size_t properties_length, size_t* length) {
+    return test_event(properties, properties_length, TEST_HEADER_SIZE, (uint32_t)properties_length, length);
+}
+
+void expect_event(const char* properties, size_t properties_length, bool is_udev, const char* action, const char* subsystem, const char* device_name, const char* what) {
+    size_t length;
+    char* buffer = test_udev_event(properties, properties_length, &length);
+    const char* parsed_action;
+    const char* parsed_subsystem;
+    const char* parsed_device_name;
+    bool parsed = hotplug_parse_event(buffer, length, &parsed_action, &parsed_subsystem, &parsed_device_name);
+    expect(parsed == is_udev && property_is(parsed_action, action) && property_is(parsed_subsystem, subsystem) && property_is(parsed_device_name, device_name), what);
+    free(buffer);
+}
+
+void expect_rejected(char* buffer, size_t length, const char* what) {
+    const char* action;
+    const char* subsystem;
+    const char* device_name;
+    expect(!hotplug_parse_event(buffer, length, &action, &subsystem, &device_name) && action == NULL && subsystem == NULL && device_name == NULL, what);
+    free(buffer);
+}
+
+#define PROPERTIES(literal) literal, sizeof(literal) - 1
+
+void test_parser(void) {
+    expect_event(PROPERTIES("ACTION=add\0SUBSYSTEM=hidraw\0DEVNAME=/dev/hidraw3\0SEQNUM=1234\0"), true, "add", "hidraw", "/dev/hidraw3", "A well formed event wasn't parsed");
+    expect_event(PROPERTIES("DEVNAME=/dev/hidraw3\0SUBSYSTEM=hidraw\0ACTION=remove\0"), true, "remove", "hidraw", "/dev/hidraw3", "Properties in another order weren't parsed");
+    expect_event(PROPERTIES(""), true, NULL, NULL, NULL, "An event without properties wasn't parsed");
+    expect_event(PROPERTIES("SUBSYSTEMS=hidraw\0ACTIONS=add\0DEVNAMES=/dev/hidraw3\0"), true, NULL, NULL, NULL, "Longer property names were taken for the ones the hub needs");
+    expect_event(PROPERTIES("ACTION=add\0SUBSYSTEM=\0"), true, "add", "", NULL, "An empty value wasn't parsed");
+    expect_event(PROPERTIES("ACTION=add\0SUBSYSTEM=hidraw\0DEVNAME=/dev/hidraw3"), true, "add", "hidraw", NULL, "A property that isn't NUL terminated was used");
+    expect_event(PROPERTIES("ACTION=add"), true, NULL, NULL, NULL, "The only property wasn't NUL terminated but was used");
+
+    size_t length;
+    char* buffer = test_event(PROPERTIES("ACTION=add\0"), TEST_HEADER_SIZE, 11, &length);
+    memcpy(buffer, "add@/dev", 8);
+    expect_rejected(buffer, length, "A kernel event was taken for udev's");
+    buffer = test_event(PROPERTIES(""), 0, 0, &length);
+    expect_rejected(buffer, 23, "A message shorter than the header was parsed");
+    buffer = test_event(PROPERTIES("ACTION=add\0"), TEST_HEADER_SIZE + 12, 0, &length);
+    expect_rejected(buffer, length, "Properties that start past the end were parsed");
+    buffer = test_event(PROPERTIES("ACTION=add\0"), TEST_HEADER_SIZE, 12, &length);
+    expect_rejected(buffer, length, "Properties that end past the end were parsed");
+    buffer = test_event(PROPERTIES("ACTION=add\0"), TEST_HEADER_SIZE, UINT32_MAX - TEST_HEADER_SIZE + 1, &length);
+    expect_rejected(buffer, length, "A properties length that wraps around was parsed");
+    buffer = test_event(PROPERTIES("ACTION=add\0"), UINT32_MAX, 11, &length);
+    expect_rejected(buffer, length, "A properties offset that wraps around was parsed");
+}
+
+void test_removal(void) {
+    // a remove event only marks the node, and leaves one that's already on its way out to the sweep
+    raw_hid_node_t* node = &test_node;
+    raw_hid_node_t* deleted_node = &test_deleted_node;
+    snprintf(node->path, sizeof(node->path), "/dev/hidraw3");
+    snprintf(deleted_node->path, sizeof(deleted_node->path), "/dev/hidraw4");
+    atomic_store(&(deleted_node->is_marked_for_deletion), true);
+    atomic_store(&(node->next), deleted_node);
+    atomic_store(&raw_hid_nodes, node);
+    raw_hid_nodes_tail = deleted_node;
+    node_index_add(node);
+    node_index_add(deleted_node);
+
+    size_t length;
+    char* buffer = test_udev_event(PROPERTIES("ACTION=remove\0SUBSYSTEM=usb\0DEVNAME=/dev/hidraw3\0"), &length);
+    expect(!hotplug_handle_event(buffer, length) && !atomic_load(&(node->is_marked_for_unregistration)), "A remove event from another subsystem was handled");
+    free(buffer);
+    buffer = test_udev_event(PROPERTIES("ACTION=remove\0SUBSYSTEM=hidraw\0DEVNAME=/dev/hidraw3\0"), &length);
+    expect(!hotplug_handle_event(buffer, length) && atomic_load(&(node->is_marked_for_unregistration)), "A remove event didn't mark its node");
+    free(buffer);
+    buffer = test_udev_event(PROPERTIES("ACTION=remove\0SUBSYSTEM=hidraw\0DEVNAME=/dev/hidraw4\0"), &length);
+    expect(!hotplug_handle_event(buffer, length) && !atomic_load(&(deleted_node->is_marked_for_unregistration)), "A remove event marked a node that was already marked for deletion");
+    free(buffer);
+    expect(atomic_load(&raw_hid_nodes) == node && atomic_load(&(node->next)) == deleted_node && raw_hid_nodes_tail == deleted_node, "A remove event changed the list");
+
+    atomic_store(&raw_hid_nodes, NULL);
+    raw_hid_nodes_tail = NULL;
+    memset(node_index, 0, sizeof(node_index));
+}
+
+int main(void) {
+    test_parser();
+    test_removal();
+    printf("Udev events, %d failures.\n", n_failures);
+    return n_failures == 0 ? 0 : 1;
+}